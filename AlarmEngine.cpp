@@ -0,0 +1,306 @@
+#include "AlarmEngine.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "BulkKernels.h"
+
+namespace {
+
+using Vector = bulk::Simd<double>::Vector;
+using Mask = decltype(Vector{} > Vector{});
+constexpr size_t Lanes = bulk::Simd<double>::Lanes;
+
+template <typename V, typename T>
+V load(const std::vector<T>& values, size_t i) {
+    V v;
+    std::memcpy(&v, values.data() + i, sizeof(v));
+    return v;
+}
+
+template <typename V, typename T>
+void store(std::vector<T>& values, size_t i, V v) {
+    std::memcpy(values.data() + i, &v, sizeof(v));
+}
+
+}
+
+AlarmEventQueue::AlarmEventQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    events.resize(size);
+    mask = size - 1;
+}
+
+bool AlarmEventQueue::push(const AlarmEvent& event) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == events.size()) {
+        droppedEvents.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    events[h & mask] = event;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+bool AlarmEventQueue::pop(AlarmEvent& event) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    event = events[t & mask];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+AlarmEngine::AlarmEngine(TagDatabase& tags) : events(1 << 16), tags(tags) {
+}
+
+bool AlarmEngine::loadFromFile(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Failed to open " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string name, tagName, direction;
+        double limit = 0, deadband = 0, onDelay = 0, offDelay = 0;
+        unsigned priority = 0;
+        if (!(iss >> name) || name[0] == '#') {
+            continue;
+        }
+        if (!(iss >> tagName >> direction >> limit) || (direction != ">" && direction != "<")) {
+            std::cerr << "Invalid alarm, expected name tag >|< limit [deadband [on_delay_ms [off_delay_ms [priority]]]]: " << line << std::endl;
+            continue;
+        }
+        iss >> deadband >> onDelay >> offDelay >> priority;
+        add(name, tagName, direction[0], limit, deadband, onDelay, offDelay, priority);
+    }
+    reserve();
+    return true;
+}
+
+bool AlarmEngine::add(const std::string& name, const std::string& tagName, char direction, double limit, double deadband,
+                      double onDelayMilliseconds, double offDelayMilliseconds, uint16_t priority) {
+    // Output tags declared from here on are appended to the image
+    tags.layout();
+
+    TagRef source = tags.find(tagName);
+    if (!source || source.type == DataType::STRUCT || source.count != 1) {
+        std::cerr << "Alarm " << name << ": " << tagName << " is not a scalar tag" << std::endl;
+        return false;
+    }
+    TagRef output = tags.find(name);
+    if (!output) {
+        tags.declare(name, DataType::BOOL, "false");
+        output = tags.find(name);
+    } else if (output.type != DataType::BOOL || output.count != 1) {
+        std::cerr << "Alarm " << name << ": a tag of that name exists and is not a BOOL" << std::endl;
+        return false;
+    }
+
+    definitions.push_back(Definition{name, source, output, direction == '<' ? -1.0 : 1.0, limit, std::max(deadband, 0.0),
+                                     std::max(onDelayMilliseconds, 0.0) * 1000, std::max(offDelayMilliseconds, 0.0) * 1000, priority});
+    return true;
+}
+
+void AlarmEngine::reserve() {
+    std::stable_sort(definitions.begin(), definitions.end(), [](const Definition& a, const Definition& b) {
+        return a.source.type < b.source.type;
+    });
+
+    size_t count = definitions.size();
+    size_t padded = (count + Lanes - 1) / Lanes * Lanes;
+    for (auto* values : {&value, &direction, &signedLimit, &deadband, &onDelay, &offDelay, &changedAt}) {
+        values->assign(padded, 0);
+    }
+    conditionMask.assign(padded, 0);
+    activeMask.assign(padded, 0);
+    acked.assign(count, 1);
+    ackRequests = std::make_unique<std::atomic<uint8_t>[]>(count);
+    // Lanes past the last alarm can never hold their condition
+    std::fill(signedLimit.begin() + count, signedLimit.end(), HUGE_VAL);
+
+    std::fill(std::begin(typeEnd), std::end(typeEnd), 0);
+    for (size_t i = 0; i < count; ++i) {
+        const Definition& definition = definitions[i];
+        names.push_back(definition.name);
+        sources.push_back(definition.source);
+        outputs.push_back(definition.output);
+        priorities.push_back(definition.priority);
+        direction[i] = definition.direction;
+        signedLimit[i] = definition.direction * definition.limit;
+        deadband[i] = definition.deadband;
+        onDelay[i] = definition.onDelay;
+        offDelay[i] = definition.offDelay;
+        typeEnd[static_cast<size_t>(definition.source.type)] = i + 1;
+    }
+    for (size_t t = 1; t < std::size(typeEnd); ++t) {
+        typeEnd[t] = std::max(typeEnd[t], typeEnd[t - 1]);
+    }
+    definitions.clear();
+    definitions.shrink_to_fit();
+}
+
+size_t AlarmEngine::find(const std::string& name) const {
+    auto it = std::find(names.begin(), names.end(), name);
+    return it == names.end() ? SIZE_MAX : it - names.begin();
+}
+
+void AlarmEngine::acknowledge(size_t alarm) {
+    if (alarm == SIZE_MAX) {
+        for (size_t i = 0; i < names.size(); ++i) {
+            ackRequests[i].store(1, std::memory_order_relaxed);
+        }
+    } else if (alarm < names.size()) {
+        ackRequests[alarm].store(1, std::memory_order_relaxed);
+    }
+    ackPending.store(true, std::memory_order_release);
+}
+
+template <typename T>
+void AlarmEngine::gather(size_t first, size_t end) {
+    const uint8_t* image = tags.data();
+    for (size_t i = first; i < end; ++i) {
+        T v;
+        std::memcpy(&v, image + sources[i].offset, sizeof(T));
+        value[i] = static_cast<double>(v);
+    }
+}
+
+void AlarmEngine::gatherBools(size_t first, size_t end) {
+    const uint8_t* image = tags.data();
+    for (size_t i = first; i < end; ++i) {
+        value[i] = (image[sources[i].offset / 8] >> (sources[i].offset % 8)) & 1;
+    }
+}
+
+void AlarmEngine::update(long long now) {
+    if (names.empty()) {
+        return;
+    }
+
+    gatherBools(0, typeEnd[static_cast<size_t>(DataType::BOOL)]);
+    gather<int8_t>(typeEnd[static_cast<size_t>(DataType::BOOL)], typeEnd[static_cast<size_t>(DataType::SINT)]);
+    gather<int16_t>(typeEnd[static_cast<size_t>(DataType::SINT)], typeEnd[static_cast<size_t>(DataType::INT)]);
+    gather<int32_t>(typeEnd[static_cast<size_t>(DataType::INT)], typeEnd[static_cast<size_t>(DataType::DINT)]);
+    gather<int64_t>(typeEnd[static_cast<size_t>(DataType::DINT)], typeEnd[static_cast<size_t>(DataType::LINT)]);
+    gather<float>(typeEnd[static_cast<size_t>(DataType::LINT)], typeEnd[static_cast<size_t>(DataType::REAL)]);
+    gather<double>(typeEnd[static_cast<size_t>(DataType::REAL)], typeEnd[static_cast<size_t>(DataType::LREAL)]);
+
+    // Scan clock times stay exact as doubles for over a hundred years
+    compute(static_cast<double>(now));
+
+    if (ackPending.load(std::memory_order_acquire)) {
+        applyAcknowledgements(now);
+    }
+}
+
+void AlarmEngine::compute(double now) {
+    Vector time = Vector{} + now;
+    for (size_t i = 0; i < value.size(); i += Lanes) {
+        Mask wasCondition = load<Mask>(conditionMask, i);
+        Mask wasActive = load<Mask>(activeMask, i);
+        Vector since = load<Vector>(changedAt, i);
+
+        // Once the condition holds, it takes the deadband to clear it
+        Vector threshold = load<Vector>(signedLimit, i) - (wasCondition ? load<Vector>(deadband, i) : Vector{});
+        Mask condition = load<Vector>(value, i) * load<Vector>(direction, i) > threshold;
+
+        // The delays count from the last change of the condition
+        since = (condition != wasCondition) ? time : since;
+        Vector held = time - since;
+        Mask active = condition ? (wasActive | (held >= load<Vector>(onDelay, i))) : (wasActive & (held < load<Vector>(offDelay, i)));
+
+        store(conditionMask, i, condition);
+        store(activeMask, i, active);
+        store(changedAt, i, since);
+
+        Mask changed = active ^ wasActive;
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            if (changed[lane]) {
+                stateChanged(i + lane, static_cast<long long>(now));
+            }
+        }
+    }
+}
+
+void AlarmEngine::stateChanged(size_t alarm, long long now) {
+    bool isActive = activeMask[alarm] != 0;
+    if (isActive) {
+        acked[alarm] = 0;
+    }
+    tags.setBool(outputs[alarm], isActive);
+    events.push(AlarmEvent{static_cast<uint32_t>(alarm), isActive ? AlarmEventKind::Raised : AlarmEventKind::Cleared, priorities[alarm],
+                           value[alarm], now});
+    ++eventCount;
+}
+
+void AlarmEngine::applyAcknowledgements(long long now) {
+    ackPending.store(false, std::memory_order_relaxed);
+    for (size_t alarm = 0; alarm < names.size(); ++alarm) {
+        if (ackRequests[alarm].exchange(0, std::memory_order_relaxed) && !acked[alarm]) {
+            acked[alarm] = 1;
+            events.push(AlarmEvent{static_cast<uint32_t>(alarm), AlarmEventKind::Acknowledged, priorities[alarm], value[alarm], now});
+            ++eventCount;
+        }
+    }
+}
+
+void AlarmEngine::printSummary(std::ostream& out) const {
+    std::vector<size_t> shown;
+    for (size_t alarm = 0; alarm < names.size(); ++alarm) {
+        if (active(alarm) || !acknowledged(alarm)) {
+            shown.push_back(alarm);
+        }
+    }
+    std::stable_sort(shown.begin(), shown.end(), [this](size_t a, size_t b) { return priorities[a] > priorities[b]; });
+
+    out << "Alarms: " << names.size() << " points, " << shown.size() << " active or unacknowledged, " << eventCount << " events, "
+        << events.dropped() << " events dropped" << std::endl;
+    for (size_t alarm : shown) {
+        out << "  " << names[alarm] << " priority " << priorities[alarm] << (active(alarm) ? " active" : " cleared")
+            << (acknowledged(alarm) ? "" : " unacknowledged") << ", value " << value[alarm] << std::endl;
+    }
+}
+
+double AlarmEngine::benchmark(size_t alarmCount, int updates) {
+    TagDatabase tags;
+    for (size_t i = 0; i < alarmCount; ++i) {
+        tags.declare("value" + std::to_string(i), DataType::REAL, "0");
+    }
+    tags.layout();
+
+    // Limits spread over the range the values sweep through, so alarms keep rising and clearing
+    AlarmEngine engine(tags);
+    for (size_t i = 0; i < alarmCount; ++i) {
+        engine.add("alarm" + std::to_string(i), "value" + std::to_string(i), i % 2 ? '<' : '>', static_cast<double>(i % 100), 2, 0, 0, i % 1000);
+    }
+    engine.reserve();
+
+    std::vector<TagRef> values;
+    for (size_t i = 0; i < alarmCount; ++i) {
+        values.push_back(tags.find("value" + std::to_string(i)));
+    }
+    AlarmEvent event;
+    double elapsed = 0;
+    for (int update = 1; update <= updates; ++update) {
+        float sweep = static_cast<float>(update % 100);
+        for (const auto& ref : values) {
+            tags.set(ref, sweep);
+        }
+        auto start = std::chrono::steady_clock::now();
+        engine.update(update * 10000LL);
+        elapsed += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        while (engine.events.pop(event)) {
+        }
+    }
+    return alarmCount * static_cast<double>(updates) / elapsed;
+}
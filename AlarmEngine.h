@@ -0,0 +1,118 @@
+#ifndef ALARM_ENGINE_H
+#define ALARM_ENGINE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "TagDatabase.h"
+
+enum class AlarmEventKind : uint8_t { Raised, Cleared, Acknowledged };
+
+struct AlarmEvent {
+    uint32_t alarm = 0; // index into AlarmEngine::name() and friends
+    AlarmEventKind kind = AlarmEventKind::Raised;
+    uint16_t priority = 0;
+    double value = 0; // of the alarm's tag when the event happened
+    long long time = 0; // scan clock in microseconds
+};
+
+// Hands alarm events from the scan thread to one consumer thread without locks. Full means the event is dropped
+// and counted, the scan never waits.
+class AlarmEventQueue {
+public:
+    explicit AlarmEventQueue(size_t capacity); // rounded up to a power of two
+
+    bool push(const AlarmEvent& event); // scan thread
+    bool pop(AlarmEvent& event); // consumer thread
+    long long dropped() const { return droppedEvents.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<AlarmEvent> events;
+    size_t mask;
+    std::atomic<size_t> head{0}; // written by the scan thread
+    std::atomic<size_t> tail{0}; // written by the consumer
+    std::atomic<long long> droppedEvents{0};
+};
+
+// Evaluates a table of alarm points once per scan, after the logic, instead of one rung per alarm.
+//
+// Alarm file, one alarm per line, everything after the limit optional:
+//   name  tag  >|<  limit  [deadband [on_delay_ms [off_delay_ms [priority]]]]
+//
+// An alarm's condition is its tag above (>) or below (<) the limit. Once the condition holds, it holds until the tag
+// is back past the limit by the deadband. The alarm becomes active when the condition has held for the on delay, and
+// inactive when it has been gone for the off delay. Raising an alarm makes it unacknowledged until acknowledge() is
+// called for it. The alarm's active state is written to a BOOL tag of the alarm's name, declared if need be, so
+// rungs can use it.
+//
+// The alarms are sorted by the type of their tag, so gathering the values into the structure-of-arrays staging is
+// one tight loop per type. Deadbands, delays and edge detection are computed on whole vectors of alarms, and only
+// alarms that changed state are looked at one by one.
+class AlarmEngine {
+public:
+    explicit AlarmEngine(TagDatabase& tags);
+
+    bool loadFromFile(const std::string& filename); // after the variables, before the logic
+    bool add(const std::string& name, const std::string& tagName, char direction, double limit, double deadband,
+             double onDelayMilliseconds, double offDelayMilliseconds, uint16_t priority);
+    void reserve(); // sorts the alarms and sizes the staging arrays once all are known, so update() does not allocate
+    void update(long long now); // in microseconds, called by the parser at the end of every scan
+
+    // Any thread: the alarm is acknowledged at the end of the next scan. SIZE_MAX acknowledges every alarm.
+    void acknowledge(size_t alarm);
+    size_t find(const std::string& name) const; // SIZE_MAX if there is no such alarm
+
+    size_t alarmCount() const { return names.size(); }
+    const std::string& name(size_t alarm) const { return names[alarm]; }
+    bool active(size_t alarm) const { return activeMask[alarm] != 0; }
+    bool acknowledged(size_t alarm) const { return acked[alarm] != 0; }
+    void printSummary(std::ostream& out) const; // the active and the unacknowledged alarms, highest priority first
+
+    AlarmEventQueue events;
+    long long eventCount = 0;
+
+    // Alarms per microsecond for a table of alarmCount alarms on REAL tags
+    static double benchmark(size_t alarmCount, int updates);
+
+private:
+    struct Definition {
+        std::string name;
+        TagRef source;
+        TagRef output;
+        double direction; // 1 for a high alarm, -1 for a low one
+        double limit;
+        double deadband;
+        double onDelay; // in microseconds
+        double offDelay;
+        uint16_t priority;
+    };
+
+    TagDatabase& tags;
+    std::vector<Definition> definitions; // until reserve()
+
+    // Per alarm, sorted by source type
+    std::vector<std::string> names;
+    std::vector<TagRef> sources;
+    std::vector<TagRef> outputs;
+    std::vector<uint16_t> priorities;
+    std::vector<uint8_t> acked;
+    std::unique_ptr<std::atomic<uint8_t>[]> ackRequests;
+    std::atomic<bool> ackPending{false};
+    size_t typeEnd[8] = {}; // alarms [typeEnd[t - 1], typeEnd[t]) have sources of DataType t
+
+    // Staging, padded to whole vectors. Comparisons give 0 or -1 masks, kept as 64 bit integers.
+    std::vector<double> value, direction, signedLimit, deadband, onDelay, offDelay, changedAt;
+    std::vector<int64_t> conditionMask, activeMask;
+
+    template <typename T>
+    void gather(size_t first, size_t end);
+    void gatherBools(size_t first, size_t end);
+    void compute(double now);
+    void stateChanged(size_t alarm, long long now);
+    void applyAcknowledgements(long long now);
+};
+
+#endif // ALARM_ENGINE_H
@@ -0,0 +1,13 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+// Hooks on the global operator new/delete, used to check that a scan does not allocate.
+// Counting is off until startCountingAllocations() is called and costs one branch per allocation otherwise.
+void startCountingAllocations();
+void stopCountingAllocations();
+size_t allocationCount();
+size_t allocatedBytes();
+
+#endif // ALLOCATION_COUNTER_H
@@ -0,0 +1,136 @@
+#ifndef BULK_KERNELS_H
+#define BULK_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Element-wise kernels for the array instructions (FAD, FSB, FMU, FDV, FGR, FLS, FEQ, FLL).
+// They work on raw tag image memory with GCC vector extensions, 16 bytes at a time so every x86-64 (SSE2) and
+// ARM (NEON) target gets real vector instructions, and a scalar loop finishes the tail. Operands need not be aligned.
+// A source marked Scalar is a single value broadcast to every element.
+namespace bulk {
+
+template <typename T>
+struct Simd {
+    typedef T Vector __attribute__((vector_size(16)));
+    static constexpr size_t Lanes = 16 / sizeof(T);
+};
+
+template <typename T, bool Scalar>
+inline typename Simd<T>::Vector loadVector(const uint8_t* data, size_t i) {
+    typename Simd<T>::Vector v;
+    if constexpr (Scalar) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        v = typename Simd<T>::Vector{} + value;
+    } else {
+        std::memcpy(&v, data + i * sizeof(T), sizeof(v));
+    }
+    return v;
+}
+
+template <typename T, bool Scalar>
+inline T loadScalar(const uint8_t* data, size_t i) {
+    T value;
+    std::memcpy(&value, data + (Scalar ? 0 : i * sizeof(T)), sizeof(T));
+    return value;
+}
+
+// dest[i] = op(a[i], b[i])
+template <typename T, bool ScalarA, bool ScalarB, typename Op>
+void elementwise(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t count, Op op) {
+    constexpr size_t Lanes = Simd<T>::Lanes;
+    size_t i = 0;
+    for (; i + Lanes <= count; i += Lanes) {
+        auto result = op(loadVector<T, ScalarA>(a, i), loadVector<T, ScalarB>(b, i));
+        std::memcpy(dest + i * sizeof(T), &result, sizeof(result));
+    }
+    for (; i < count; ++i) {
+        T result = op(loadScalar<T, ScalarA>(a, i), loadScalar<T, ScalarB>(b, i));
+        std::memcpy(dest + i * sizeof(T), &result, sizeof(T));
+    }
+}
+
+// dest[i] = compare(a[i], b[i]) ? 1 : 0, returns true if the comparison held for any element
+template <typename T, bool ScalarA, bool ScalarB, typename Compare>
+bool compare(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t count, Compare compare) {
+    using Vector = typename Simd<T>::Vector;
+    constexpr size_t Lanes = Simd<T>::Lanes;
+    size_t i = 0;
+    bool any = false;
+    if (count >= Lanes) {
+        // Comparing vectors gives -1 for true lanes and 0 for false ones, in an integer vector of the same width
+        decltype(compare(Vector{}, Vector{})) found{};
+        for (; i + Lanes <= count; i += Lanes) {
+            auto mask = compare(loadVector<T, ScalarA>(a, i), loadVector<T, ScalarB>(b, i));
+            found |= mask;
+            Vector result = __builtin_convertvector(-mask, Vector);
+            std::memcpy(dest + i * sizeof(T), &result, sizeof(result));
+        }
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            any = any || found[lane];
+        }
+    }
+    for (; i < count; ++i) {
+        bool held = compare(loadScalar<T, ScalarA>(a, i), loadScalar<T, ScalarB>(b, i));
+        T result = held ? 1 : 0;
+        std::memcpy(dest + i * sizeof(T), &result, sizeof(T));
+        any = any || held;
+    }
+    return any;
+}
+
+template <typename T>
+void fill(uint8_t* dest, T value, size_t count) {
+    constexpr size_t Lanes = Simd<T>::Lanes;
+    auto v = typename Simd<T>::Vector{} + value;
+    size_t i = 0;
+    for (; i + Lanes <= count; i += Lanes) {
+        std::memcpy(dest + i * sizeof(T), &v, sizeof(v));
+    }
+    for (; i < count; ++i) {
+        std::memcpy(dest + i * sizeof(T), &value, sizeof(T));
+    }
+}
+
+// Picks the kernel for array and single value sources
+template <typename T, typename Op>
+void elementwise(uint8_t* dest, const uint8_t* a, bool scalarA, const uint8_t* b, bool scalarB, size_t count, Op op) {
+    if (scalarA && scalarB) {
+        elementwise<T, true, true>(dest, a, b, count, op);
+    } else if (scalarA) {
+        elementwise<T, true, false>(dest, a, b, count, op);
+    } else if (scalarB) {
+        elementwise<T, false, true>(dest, a, b, count, op);
+    } else {
+        elementwise<T, false, false>(dest, a, b, count, op);
+    }
+}
+
+template <typename T, typename Compare>
+bool compare(uint8_t* dest, const uint8_t* a, bool scalarA, const uint8_t* b, bool scalarB, size_t count, Compare op) {
+    if (scalarA && scalarB) {
+        return compare<T, true, true>(dest, a, b, count, op);
+    } else if (scalarA) {
+        return compare<T, true, false>(dest, a, b, count, op);
+    } else if (scalarB) {
+        return compare<T, false, true>(dest, a, b, count, op);
+    }
+    return compare<T, false, false>(dest, a, b, count, op);
+}
+
+// True if any of count elements is zero, checked before an integer divide
+template <typename T>
+bool containsZero(const uint8_t* data, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (loadScalar<T, false>(data, i) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+#endif // BULK_KERNELS_H
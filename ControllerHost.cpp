@@ -0,0 +1,249 @@
+#include "ControllerHost.h"
+#include <algorithm>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+std::atomic<bool> stopRequested{false};
+
+void requestStop(int) {
+    stopRequested.store(true, std::memory_order_relaxed);
+}
+
+long long microseconds(Controller::Clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+}
+
+ControllerHost::ControllerHost(size_t workerCount) {
+    for (size_t i = 0; i < std::max<size_t>(workerCount, 1); ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+}
+
+ControllerHost::~ControllerHost() {
+    stopping.store(true);
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) {
+            queued.release();
+        }
+    }
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+bool ControllerHost::loadConfig(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Failed to open " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    bool ok = true;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string name, logicFile, variablesFile;
+        int period = 0;
+        if (!(iss >> name) || name[0] == '#') {
+            continue;
+        }
+        if (!(iss >> logicFile >> variablesFile >> period) || period <= 0) {
+            std::cerr << "Invalid controller line, expected name logic_file variables_file period_ms: " << line << std::endl;
+            ok = false;
+            continue;
+        }
+        ok = addController(name, logicFile, variablesFile, period) && ok;
+    }
+    return ok;
+}
+
+bool ControllerHost::addController(const std::string& name, const std::string& logicFile, const std::string& variablesFile, int periodMilliseconds) {
+    auto controller = std::make_unique<Controller>();
+    controller->name = name;
+    controller->period = std::chrono::milliseconds(periodMilliseconds);
+    controller->homeWorker = controllers.size() % workers.size();
+
+    std::ifstream file(logicFile);
+    if (!file) {
+        std::cerr << name << ": failed to open " << logicFile << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        controller->logic.push_back(line);
+    }
+    if (!controller->tags.loadFromFile(variablesFile)) {
+        std::cerr << name << ": failed to load " << variablesFile << std::endl;
+        return false;
+    }
+
+    controller->parser = std::make_unique<LadderLogicParser>(controller->logic, controller->tags);
+    controller->parser->traceEnabled = false;
+    controllers.push_back(std::move(controller));
+    return true;
+}
+
+void ControllerHost::run(long long durationMilliseconds) {
+    stopping.store(false);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->thread = std::thread(&ControllerHost::workerLoop, this, i);
+    }
+
+    stopRequested.store(false);
+    auto previousInterrupt = std::signal(SIGINT, requestStop);
+    auto previousTerminate = std::signal(SIGTERM, requestStop);
+
+    auto start = Controller::Clock::now();
+    schedule(durationMilliseconds);
+    runTime = std::chrono::duration_cast<std::chrono::milliseconds>(Controller::Clock::now() - start).count();
+
+    std::signal(SIGINT, previousInterrupt);
+    std::signal(SIGTERM, previousTerminate);
+
+    // Every worker wakes up once more, finds nothing and exits
+    stopping.store(true);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        queued.release();
+    }
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+}
+
+void ControllerHost::schedule(long long durationMilliseconds) {
+    using namespace std::chrono;
+
+    auto start = Controller::Clock::now();
+    auto end = durationMilliseconds > 0 ? start + milliseconds(durationMilliseconds) : Controller::Clock::time_point::max();
+    for (auto& controller : controllers) {
+        controller->nextRelease = start;
+        controller->lastStart = start - controller->period;
+    }
+
+    while (!stopRequested.load(std::memory_order_relaxed)) {
+        auto now = Controller::Clock::now();
+        if (now >= end) {
+            break;
+        }
+
+        auto wake = end;
+        for (auto& controller : controllers) {
+            if (controller->nextRelease <= now) {
+                if (controller->busy.exchange(true, std::memory_order_acquire)) {
+                    ++controller->skipped;
+                } else {
+                    controller->release = controller->nextRelease;
+                    Worker& worker = *workers[controller->homeWorker];
+                    {
+                        std::lock_guard<std::mutex> lock(worker.mutex);
+                        worker.queue.push_back(controller.get());
+                    }
+                    queued.release();
+                }
+
+                // Periods that have already gone by are not made up, the controller waits for the next one
+                controller->nextRelease += controller->period;
+                while (controller->nextRelease <= now) {
+                    controller->nextRelease += controller->period;
+                    ++controller->skipped;
+                }
+            }
+            wake = std::min(wake, controller->nextRelease);
+        }
+
+        // Wake up now and then even with long periods, to notice Ctrl-C
+        std::this_thread::sleep_until(std::min(wake, now + milliseconds(100)));
+    }
+}
+
+void ControllerHost::workerLoop(size_t index) {
+    while (true) {
+        queued.acquire();
+        Controller* controller = takeWork(index);
+        if (controller) {
+            scan(*controller, index);
+        } else if (stopping.load()) {
+            return;
+        }
+    }
+}
+
+Controller* ControllerHost::takeWork(size_t index) {
+    // Newest work from our own queue first, while its tags may still be in this core's cache
+    Worker& own = *workers[index];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.queue.empty()) {
+            Controller* controller = own.queue.back();
+            own.queue.pop_back();
+            return controller;
+        }
+    }
+
+    // Otherwise steal the oldest work from the next busy worker
+    for (size_t offset = 1; offset < workers.size(); ++offset) {
+        Worker& victim = *workers[(index + offset) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.queue.empty()) {
+            Controller* controller = victim.queue.front();
+            victim.queue.pop_front();
+            ++own.steals;
+            return controller;
+        }
+    }
+    return nullptr;
+}
+
+void ControllerHost::scan(Controller& controller, size_t worker) {
+    auto start = Controller::Clock::now();
+    controller.maxLatency = std::max(controller.maxLatency, microseconds(start - controller.release));
+
+    // Timers advance by the real time since this controller's previous scan
+    controller.parser->executeLogic(microseconds(start - controller.lastStart));
+    controller.lastStart = start;
+
+    auto finish = Controller::Clock::now();
+    long long execution = microseconds(finish - start);
+    ++controller.scans;
+    controller.totalExecution += execution;
+    controller.maxExecution = std::max(controller.maxExecution, execution);
+    if (finish > controller.release + controller.period) {
+        ++controller.deadlineMisses;
+    }
+    ++workers[worker]->scans;
+
+    controller.busy.store(false, std::memory_order_release);
+}
+
+void ControllerHost::printReport(std::ostream& out) const {
+    long long steals = 0;
+    for (const auto& worker : workers) {
+        steals += worker->steals;
+    }
+
+    out << "-------" << "Controller host:" << "-------" << std::endl;
+    out << "Controllers: " << controllers.size() << ", workers: " << workers.size() << ", run time: " << runTime << " ms, steals: " << steals << std::endl;
+    out << std::left << std::setw(16) << "Controller" << std::right << std::setw(8) << "Period" << std::setw(10) << "Scans"
+        << std::setw(10) << "Skipped" << std::setw(10) << "Missed" << std::setw(14) << "Latency max" << std::setw(14) << "Exec avg/max" << std::endl;
+    for (const auto& controller : controllers) {
+        std::ostringstream execution;
+        execution << (controller->scans ? controller->totalExecution / controller->scans : 0) << "/" << controller->maxExecution;
+        out << std::left << std::setw(16) << controller->name << std::right
+            << std::setw(6) << std::chrono::duration_cast<std::chrono::milliseconds>(controller->period).count() << "ms"
+            << std::setw(10) << controller->scans << std::setw(10) << controller->skipped << std::setw(10) << controller->deadlineMisses
+            << std::setw(12) << controller->maxLatency << "us" << std::setw(12) << execution.str() << "us" << std::endl;
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        out << "Worker " << i << ": " << workers[i]->scans << " scans, " << workers[i]->steals << " stolen" << std::endl;
+    }
+    out << "-------" << "-------" << std::endl;
+}
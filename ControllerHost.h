@@ -0,0 +1,78 @@
+#ifndef CONTROLLER_HOST_H
+#define CONTROLLER_HOST_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <semaphore>
+#include <string>
+#include <thread>
+#include <vector>
+#include "LadderLogicParser.h"
+#include "TagDatabase.h"
+
+// One hosted program: its own logic, tags and scan period
+struct Controller {
+    using Clock = std::chrono::steady_clock;
+
+    std::string name;
+    std::vector<std::string> logic;
+    TagDatabase tags;
+    std::unique_ptr<LadderLogicParser> parser;
+    Clock::duration period;
+    size_t homeWorker = 0; // worker whose queue it is released to, other workers steal it when that one is busy
+
+    // Set from release until the scan finishes, a busy controller's next release is skipped instead of queued
+    std::atomic<bool> busy{false};
+    Clock::time_point nextRelease;
+    Clock::time_point release; // of the scan that is queued or running
+    Clock::time_point lastStart;
+
+    long long scans = 0;
+    long long skipped = 0; // releases dropped because the previous scan had not finished yet
+    long long deadlineMisses = 0; // scans that finished after their next release time
+    long long maxLatency = 0; // in microseconds, from release to start of the scan
+    long long totalExecution = 0; // in microseconds
+    long long maxExecution = 0;
+};
+
+// Runs many independent controllers in one process on a fixed pool of worker threads.
+// A scheduler thread releases each controller when its period comes round and puts it on its home worker's
+// queue; idle workers steal from the other queues. A controller never runs on two workers at once, and one that
+// overruns only loses its own releases, so it cannot flood the queues and starve the others.
+class ControllerHost {
+public:
+    explicit ControllerHost(size_t workerCount);
+    ~ControllerHost();
+
+    bool loadConfig(const std::string& filename); // lines of "name logic_file variables_file period_ms"
+    bool addController(const std::string& name, const std::string& logicFile, const std::string& variablesFile, int periodMilliseconds);
+    void run(long long durationMilliseconds); // 0 runs until interrupted
+    void printReport(std::ostream& out) const;
+    size_t controllerCount() const { return controllers.size(); }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Controller*> queue;
+        std::thread thread;
+        long long scans = 0;
+        long long steals = 0;
+    };
+
+    std::vector<std::unique_ptr<Controller>> controllers;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::counting_semaphore<> queued{0}; // one count per controller waiting in any queue
+    std::atomic<bool> stopping{false};
+    long long runTime = 0; // in milliseconds
+
+    void workerLoop(size_t index);
+    Controller* takeWork(size_t index);
+    void scan(Controller& controller, size_t worker);
+    void schedule(long long durationMilliseconds);
+};
+
+#endif // CONTROLLER_HOST_H
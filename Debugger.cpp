@@ -0,0 +1,578 @@
+#include "Debugger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "AlarmEngine.h"
+#include "LadderLogicParser.h"
+
+namespace {
+
+constexpr size_t MaxSnapshots = 16;
+
+const char* helpText =
+    "force <tag> <value> | unforce <tag>|all\n"
+    "watch <tag> [<op> <value>] | unwatch <tag>|all\n"
+    "break <rung> [<tag> <op> <value>] | delete <rung>|all | continue | step\n"
+    "rungs: <number> in the main program, <routine>/<number> in a subroutine\n"
+    "get <tag> | snapshot <id> [<tag>] | list | help\n"
+    "alarms | ack <alarm>|all\n"
+    "ops: > < = !\n";
+
+}
+
+Debugger::Debugger(LadderLogicParser& parser, TagDatabase& tags, bool breakpointsAllowed) :
+    parser(parser),
+    tags(tags),
+    breakpointsAllowed(breakpointsAllowed) {
+}
+
+Debugger::~Debugger() {
+    running.store(false);
+    if (server.joinable()) {
+        server.join();
+    }
+    if (client.load() >= 0) {
+        close(client.load());
+    }
+    if (listener >= 0) {
+        close(listener);
+        unlink(socketPath.c_str());
+    }
+}
+
+bool Debugger::start(const std::string& path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Debug socket path is too long: " << path << std::endl;
+        return false;
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 1) != 0) {
+        std::cerr << "Could not open debug socket " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    socketPath = path;
+    running.store(true);
+    server = std::thread(&Debugger::serve, this);
+    return true;
+}
+
+void Debugger::serve() {
+    std::string pending;
+    while (running.load()) {
+        pollfd fds[2] = {{listener, POLLIN, 0}, {client.load(), POLLIN, 0}};
+        if (poll(fds, client.load() >= 0 ? 2 : 1, 100) <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            // A new client replaces the old one
+            int connection = accept(listener, nullptr, nullptr);
+            if (connection >= 0) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    int previous = client.exchange(connection);
+                    if (previous >= 0) {
+                        close(previous);
+                    }
+                }
+                pending.clear();
+                reply("ladder_logic debugger, type help for commands");
+            }
+            continue;
+        }
+
+        if (client.load() >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            char buffer[512];
+            ssize_t received = read(client.load(), buffer, sizeof(buffer));
+            if (received <= 0) {
+                // Nobody is left to resume a paused scan
+                std::lock_guard<std::mutex> lock(mutex);
+                close(client.exchange(-1));
+                commands.push_back("disconnect");
+                commandsPending.store(true);
+                commandArrived.notify_one();
+                continue;
+            }
+
+            pending.append(buffer, received);
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (!line.empty()) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    commands.push_back(line);
+                    commandsPending.store(true);
+                    commandArrived.notify_one();
+                }
+            }
+        }
+    }
+}
+
+void Debugger::reply(const std::string& text) {
+    std::string line = text + "\n";
+    // Held so the socket thread cannot close the descriptor, and accept another client on it, before the send
+    std::lock_guard<std::mutex> lock(mutex);
+    int fd = client.load();
+    if (fd >= 0) {
+        send(fd, line.data(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+void Debugger::scanStart() {
+    ++scan;
+    if (commandsPending.load(std::memory_order_relaxed)) {
+        processCommands();
+    }
+    if (!watches.empty()) {
+        // Changes made between scans, by I/O or another program
+        checkWatches("between scans");
+    }
+    applyForces();
+}
+
+void Debugger::scanEnd() {
+    // The PID engine writes its outputs after the last rung
+    applyForces();
+    if (!watches.empty()) {
+        checkWatches("end of scan");
+    }
+}
+
+void Debugger::beforeRung(size_t rung) {
+    if (commandsPending.load(std::memory_order_relaxed)) {
+        processCommands();
+    }
+    if (stepping) {
+        pause("step at rung " + rungName(rung));
+        return;
+    }
+    for (const auto& breakpoint : breakpoints) {
+        if (breakpoint.rung != rung) {
+            continue;
+        }
+        if (breakpoint.tagName.empty() || conditionHolds(breakpoint.condition, tags.get<double>(breakpoint.ref), breakpoint.threshold)) {
+            pause("break at rung " + rungName(rung) + " scan " + std::to_string(scan));
+            return;
+        }
+    }
+}
+
+void Debugger::afterInstruction(const Instruction& instruction) {
+    applyForces();
+    if (!watches.empty()) {
+        checkWatches("", &instruction);
+    }
+}
+
+void Debugger::pause(const std::string& reason) {
+    if (client.load() < 0) {
+        // The client went away, its disconnect clears the breakpoints with the next commands
+        return;
+    }
+    paused = true;
+    stepping = false;
+    reply(reason);
+
+    // The scan thread waits here and carries out commands until it is told to go on
+    while (paused) {
+        std::unique_lock<std::mutex> lock(mutex);
+        commandArrived.wait(lock, [this]() { return !commands.empty(); });
+        lock.unlock();
+        processCommands();
+    }
+}
+
+void Debugger::processCommands() {
+    std::deque<std::string> batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch.swap(commands);
+        commandsPending.store(false);
+    }
+    for (const auto& command : batch) {
+        execute(command);
+    }
+}
+
+void Debugger::execute(const std::string& command) {
+    std::istringstream iss(command);
+    std::string verb, name, op, value;
+    iss >> verb >> name >> op >> value;
+
+    if (verb == "disconnect") {
+        // Breakpoints without a client would pause the scan with nobody to continue it, forces and watches stay
+        breakpoints.clear();
+        paused = false;
+        stepping = false;
+    } else if (verb == "help") {
+        reply(helpText);
+    } else if (verb == "force") {
+        TagRef ref = tags.find(name);
+        if (!ref || ref.type == DataType::STRUCT || ref.count != 1 || op.empty()) {
+            reply("error: force needs a scalar tag and a value");
+            return;
+        }
+        double forced = op == "true" ? 1 : op == "false" ? 0 : std::strtod(op.c_str(), nullptr);
+        forces.erase(std::remove_if(forces.begin(), forces.end(), [&name](const Force& force) { return force.name == name; }), forces.end());
+        forces.push_back(Force{name, ref, forced});
+        applyForces();
+        repatch();
+        reply("ok forced " + name + " = " + valueText(tags, ref));
+    } else if (verb == "unforce") {
+        forces.erase(std::remove_if(forces.begin(), forces.end(), [&name](const Force& force) { return name == "all" || force.name == name; }), forces.end());
+        repatch();
+        reply("ok");
+    } else if (verb == "watch") {
+        TagRef ref = tags.find(name);
+        Condition condition = Condition::Change;
+        if (!ref || ref.type == DataType::STRUCT || ref.count != 1 || (!op.empty() && !parseCondition(op, condition))) {
+            reply("error: watch needs a scalar tag and optionally a condition like > 50");
+            return;
+        }
+        double current = tags.get<double>(ref);
+        double threshold = value.empty() ? 0 : std::strtod(value.c_str(), nullptr);
+        watches.erase(std::remove_if(watches.begin(), watches.end(), [&name](const Watch& watch) { return watch.name == name; }), watches.end());
+        watches.push_back(Watch{name, ref, condition, threshold, current, conditionHolds(condition, current, threshold)});
+        repatch();
+        reply("ok watching " + name);
+    } else if (verb == "unwatch") {
+        watches.erase(std::remove_if(watches.begin(), watches.end(), [&name](const Watch& watch) { return name == "all" || watch.name == name; }), watches.end());
+        repatch();
+        reply("ok");
+    } else if (verb == "break") {
+        if (!breakpointsAllowed) {
+            reply("error: breakpoints only work in simulation mode");
+            return;
+        }
+        Breakpoint breakpoint{findRung(name), op, TagRef{}, Condition::Change, 0};
+        if (breakpoint.rung == SIZE_MAX) {
+            reply("error: no rung " + name);
+            return;
+        }
+        if (!op.empty()) {
+            std::string conditionOp, threshold;
+            iss >> conditionOp >> threshold;
+            breakpoint.ref = tags.find(op);
+            // break <rung> <tag> <op> <value>: the tag was read into op and the operator into value
+            if (!breakpoint.ref || !parseCondition(value, breakpoint.condition) || conditionOp.empty()) {
+                reply("error: break <rung> [<tag> <op> <value>]");
+                return;
+            }
+            breakpoint.threshold = std::strtod(conditionOp.c_str(), nullptr);
+        }
+        breakpoints.push_back(breakpoint);
+        reply("ok break at rung " + rungName(breakpoint.rung));
+    } else if (verb == "delete") {
+        breakpoints.erase(std::remove_if(breakpoints.begin(), breakpoints.end(), [this, &name](const Breakpoint& breakpoint) {
+            return name == "all" || rungName(breakpoint.rung) == name;
+        }), breakpoints.end());
+        reply("ok");
+    } else if (verb == "continue") {
+        paused = false;
+        reply("ok running");
+    } else if (verb == "step") {
+        if (!breakpointsAllowed) {
+            reply("error: stepping only works in simulation mode");
+            return;
+        }
+        stepping = true;
+        paused = false;
+    } else if (verb == "get") {
+        TagRef ref = tags.find(name);
+        reply(ref ? name + " = " + valueText(tags, ref) : "error: unknown tag " + name);
+    } else if (verb == "snapshot") {
+        int id = std::atoi(name.c_str());
+        auto it = std::find_if(snapshots.begin(), snapshots.end(), [id](const Snapshot& snapshot) { return snapshot.id == id; });
+        if (it == snapshots.end()) {
+            reply("error: no snapshot " + name);
+            return;
+        }
+        std::ostringstream out;
+        out << "snapshot " << it->id << " scan " << it->scan << " " << it->where;
+        for (const auto& [tagName, i] : it->tags.names()) {
+            if (op.empty() || op == tagName) {
+                out << "\n  " << tagName << " = " << valueText(it->tags, it->tags.tag(i).ref);
+            }
+        }
+        reply(out.str());
+    } else if (verb == "list") {
+        std::ostringstream out;
+        for (const auto& force : forces) {
+            out << "force " << force.name << " = " << valueText(tags, force.ref) << "\n";
+        }
+        for (const auto& watch : watches) {
+            out << "watch " << watch.name << "\n";
+        }
+        for (const auto& breakpoint : breakpoints) {
+            out << "break " << rungName(breakpoint.rung) << (breakpoint.tagName.empty() ? "" : " if " + breakpoint.tagName) << "\n";
+        }
+        for (const auto& snapshot : snapshots) {
+            out << "snapshot " << snapshot.id << " scan " << snapshot.scan << " " << snapshot.where << "\n";
+        }
+        out << "scan " << scan << (paused ? ", paused" : "");
+        reply(out.str());
+    } else if (verb == "alarms" || verb == "ack") {
+        if (!alarms) {
+            reply("error: no alarms loaded, start with --alarms <file>");
+            return;
+        }
+        if (verb == "ack") {
+            size_t alarm = name == "all" ? SIZE_MAX : alarms->find(name);
+            if (name != "all" && alarm == SIZE_MAX) {
+                reply("error: no alarm " + name);
+                return;
+            }
+            // Acknowledged at the end of this scan, the engine reports it as an event
+            alarms->acknowledge(alarm);
+            reply("ok acknowledging " + name);
+            return;
+        }
+        std::ostringstream out;
+        alarms->printSummary(out);
+        std::string text = out.str();
+        text.pop_back();
+        reply(text);
+    } else {
+        reply("error: unknown command " + verb + ", type help");
+    }
+}
+
+void Debugger::applyForces() {
+    for (const auto& force : forces) {
+        tags.set(force.ref, force.value);
+    }
+}
+
+void Debugger::checkWatches(const char* where, const Instruction* instruction) {
+    for (auto& watch : watches) {
+        double current = tags.get<double>(watch.ref);
+        bool held = conditionHolds(watch.condition, current, watch.threshold);
+        bool triggered = watch.condition == Condition::Change ? current != watch.lastValue : held && !watch.lastHeld;
+        if (triggered) {
+            std::ostringstream place;
+            place << where;
+            if (instruction) {
+                // Only looked up when a watch triggers, the hook itself does not track the rung
+                const auto& rungs = parser.compiledRungs();
+                for (size_t i = 0; i < rungs.size(); ++i) {
+                    if (!rungs[i].instructions.empty() && instruction >= &rungs[i].instructions.front() && instruction <= &rungs[i].instructions.back()) {
+                        place << "rung " << rungName(i) << " ";
+                    }
+                }
+                place << instruction->opcode << "(" << instruction->params << ")";
+            }
+            if (snapshots.size() == MaxSnapshots) {
+                snapshots.pop_front();
+            }
+            snapshots.push_back(Snapshot{nextSnapshot++, scan, place.str(), tags});
+
+            std::ostringstream event;
+            event << "watch " << watch.name << " " << watch.lastValue << " -> " << current << " at scan " << scan << " "
+                  << place.str() << ", snapshot " << snapshots.back().id;
+            reply(event.str());
+        }
+        watch.lastValue = current;
+        watch.lastHeld = held;
+    }
+}
+
+void Debugger::programChanged(const std::vector<size_t>& moved) {
+    // Breakpoints follow their rung, those on removed rungs go
+    size_t before = breakpoints.size();
+    breakpoints.erase(std::remove_if(breakpoints.begin(), breakpoints.end(), [&moved](const Breakpoint& breakpoint) {
+        return moved[breakpoint.rung] == SIZE_MAX;
+    }), breakpoints.end());
+    for (auto& breakpoint : breakpoints) {
+        breakpoint.rung = moved[breakpoint.rung];
+    }
+    if (breakpoints.size() != before) {
+        reply("program changed, " + std::to_string(before - breakpoints.size()) + " breakpoint(s) on removed rungs deleted");
+    }
+    // New and edited rungs may write forced or watched tags
+    repatch();
+}
+
+void Debugger::repatch() {
+    std::vector<TagRef> refs;
+    for (const auto& force : forces) {
+        refs.push_back(force.ref);
+    }
+    for (const auto& watch : watches) {
+        refs.push_back(watch.ref);
+    }
+    parser.patchWriters(refs);
+}
+
+bool Debugger::parseCondition(const std::string& op, Condition& condition) const {
+    if (op == ">" || op == "<" || op == "=" || op == "!") {
+        condition = static_cast<Condition>(op[0]);
+        return true;
+    }
+    return false;
+}
+
+bool Debugger::conditionHolds(Condition condition, double value, double threshold) const {
+    switch (condition) {
+        case Condition::Change: return false;
+        case Condition::Greater: return value > threshold;
+        case Condition::Less: return value < threshold;
+        case Condition::Equal: return value == threshold;
+        case Condition::NotEqual: return value != threshold;
+    }
+    return false;
+}
+
+std::string Debugger::valueText(const TagDatabase& source, TagRef ref) const {
+    std::ostringstream out;
+    source.printValue(out, ref);
+    return out.str();
+}
+
+size_t Debugger::findRung(const std::string& name) const {
+    // Rung numbers start again in every routine, a plain number is a rung of the main program
+    const auto& routines = parser.compiledRoutines();
+    size_t slash = name.find('/');
+    std::string routineName = slash == std::string::npos ? routines.front().name : name.substr(0, slash);
+    std::string number = slash == std::string::npos ? name : name.substr(slash + 1);
+
+    auto routine = std::find_if(routines.begin(), routines.end(), [&routineName](const Routine& routine) { return routine.name == routineName; });
+    if (routine == routines.end()) {
+        return SIZE_MAX;
+    }
+    const auto& rungs = parser.compiledRungs();
+    for (size_t rung = routine->firstRung; rung < routine->endRung; ++rung) {
+        if (rungs[rung].number == number) {
+            return rung;
+        }
+    }
+    return SIZE_MAX;
+}
+
+std::string Debugger::rungName(size_t rung) const {
+    const auto& routines = parser.compiledRoutines();
+    const std::string& number = parser.compiledRungs()[rung].number;
+    if (rung < routines.front().endRung) {
+        return number;
+    }
+    auto routine = std::find_if(routines.begin(), routines.end(), [rung](const Routine& routine) { return rung < routine.endRung && rung >= routine.firstRung; });
+    return routine == routines.end() ? number : routine->name + "/" + number;
+}
+
+bool Debugger::selfTest(std::ostream& out) {
+    std::string path = (std::filesystem::temp_directory_path() / ("ladder_logic_debug_" + std::to_string(getpid()) + ".sock")).string();
+
+    TagDatabase tags;
+    tags.declare("count", DataType::DINT, "0");
+    tags.declare("one", DataType::DINT, "1");
+    tags.layout();
+    LadderLogicParser parser({"001 ADD(count,one,count)"}, tags);
+    parser.traceEnabled = false;
+    parser.setVirtualClock(10000);
+
+    Debugger debugger(parser, tags, true);
+    if (!debugger.start(path)) {
+        return false;
+    }
+    parser.setDebugger(&debugger);
+
+    auto connectClient = [&path]() {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    };
+    // Reads replies until one contains the text, or two seconds went by without it
+    auto awaitReply = [](int fd, const std::string& text) {
+        std::string received;
+        char buffer[512];
+        pollfd entry{fd, POLLIN, 0};
+        while (received.find(text) == std::string::npos && poll(&entry, 1, 2000) > 0) {
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                break;
+            }
+            received.append(buffer, length);
+        }
+        return received.find(text) != std::string::npos;
+    };
+    auto command = [](int fd, const std::string& text) {
+        std::string line = text + "\n";
+        send(fd, line.data(), line.size(), MSG_NOSIGNAL);
+    };
+
+    // The scan runs on its own thread, as it does next to the socket thread in a simulation
+    std::atomic<long long> scans{0};
+    std::atomic<bool> scanning{true};
+    std::thread scanThread([&]() {
+        while (scanning.load()) {
+            parser.executeLogic();
+            scans.fetch_add(1);
+        }
+    });
+
+    bool passed = true;
+    auto check = [&out, &passed](const char* name, bool ok) {
+        out << "Debugger self-test " << name << ": " << (ok ? "passed" : "FAILED") << std::endl;
+        passed = passed && ok;
+    };
+
+    int fd = connectClient();
+    bool hit = fd >= 0 && awaitReply(fd, "debugger");
+    if (hit) {
+        command(fd, "break 001");
+        hit = awaitReply(fd, "break at rung 001 scan");
+    }
+    check("breakpoint pauses the scan", hit);
+
+    // Nobody is left to continue, the scan has to go on by itself
+    if (fd >= 0) {
+        close(fd);
+    }
+    long long before = scans.load();
+    for (int waited = 0; waited < 2000 && scans.load() < before + 100; ++waited) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool resumed = scans.load() >= before + 100;
+    check("scan runs on after the client disconnected at a breakpoint", resumed);
+
+    if (!resumed) {
+        // Let the stuck scan go, so the scan thread can be joined
+        fd = connectClient();
+        if (fd >= 0) {
+            awaitReply(fd, "debugger");
+            command(fd, "delete all");
+            command(fd, "continue");
+            awaitReply(fd, "ok running");
+        }
+    }
+    scanning.store(false);
+    scanThread.join();
+    if (fd >= 0 && !resumed) {
+        close(fd);
+    }
+    return passed;
+}
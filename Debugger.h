@@ -0,0 +1,125 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TagDatabase.h"
+
+class AlarmEngine;
+class LadderLogicParser;
+struct Instruction;
+
+// Online debugger on a local (AF_UNIX) socket, one client at a time, one text command per line:
+//
+//   force <tag> <value>           hold a tag at a value, against both the logic and the outside world
+//   unforce <tag>|all
+//   watch <tag> [<op> <value>]    snapshot the tag image when the tag changes, or when the condition becomes true
+//   unwatch <tag>|all
+//   break <rung> [<tag> <op> <value>]   pause before a rung, simulation mode only
+//   delete <rung>|all             rungs of the main program by number, those of a subroutine as <routine>/<number>
+//   continue | step               resume from a breakpoint, step pauses again before the next rung
+//   get <tag> | snapshot <id> [<tag>] | list | help
+//   alarms | ack <alarm>|all      the active and unacknowledged alarms, acknowledge one or all of them
+//
+// A socket thread only reads commands; they are carried out on the scan thread at the next scan boundary (or at
+// once while paused). Nothing is added to the normal scan path: only the instructions that write a forced or
+// watched tag have their handler replaced by the debug hook, and the per-rung breakpoint check is a separate scan
+// loop the parser only uses while a breakpoint is set.
+class Debugger {
+public:
+    Debugger(LadderLogicParser& parser, TagDatabase& tags, bool breakpointsAllowed);
+    ~Debugger();
+
+    bool start(const std::string& socketPath);
+    static bool selfTest(std::ostream& out); // sets a breakpoint over the socket, disconnects and checks the scan goes on
+    void setAlarms(AlarmEngine* alarms) { this->alarms = alarms; }
+
+    // Called by the parser
+    void scanStart();
+    void scanEnd();
+    void beforeRung(size_t rung);
+    void afterInstruction(const Instruction& instruction);
+    bool breakpointsActive() const { return !breakpoints.empty() || stepping; }
+    void programChanged(const std::vector<size_t>& moved); // a reload moved running rung i to moved[i], SIZE_MAX if removed
+
+private:
+    enum class Condition : char { Change = 0, Greater = '>', Less = '<', Equal = '=', NotEqual = '!' };
+
+    struct Force {
+        std::string name;
+        TagRef ref;
+        double value;
+    };
+
+    struct Watch {
+        std::string name;
+        TagRef ref;
+        Condition condition;
+        double threshold;
+        double lastValue;
+        bool lastHeld;
+    };
+
+    struct Breakpoint {
+        size_t rung;
+        std::string tagName; // empty for an unconditional breakpoint
+        TagRef ref;
+        Condition condition;
+        double threshold;
+    };
+
+    struct Snapshot {
+        int id;
+        long long scan;
+        std::string where;
+        TagDatabase tags; // a copy of every tag at that moment
+    };
+
+    LadderLogicParser& parser;
+    TagDatabase& tags;
+    bool breakpointsAllowed;
+    AlarmEngine* alarms = nullptr;
+
+    std::vector<Force> forces;
+    std::vector<Watch> watches;
+    std::vector<Breakpoint> breakpoints;
+    std::deque<Snapshot> snapshots; // the most recent ones
+    int nextSnapshot = 1;
+    long long scan = 0;
+    bool stepping = false;
+    bool paused = false;
+
+    // Shared with the socket thread, the mutex also keeps the client socket from being closed during a reply
+    std::mutex mutex;
+    std::condition_variable commandArrived;
+    std::deque<std::string> commands;
+    std::atomic<bool> commandsPending{false};
+    std::atomic<int> client{-1};
+    int listener = -1;
+    std::string socketPath;
+    std::atomic<bool> running{false};
+    std::thread server;
+
+    void serve();
+    void processCommands();
+    void execute(const std::string& command);
+    void reply(const std::string& text);
+    void applyForces();
+    void checkWatches(const char* where, const Instruction* instruction = nullptr);
+    void repatch();
+    void pause(const std::string& reason);
+    bool parseCondition(const std::string& op, Condition& condition) const;
+    bool conditionHolds(Condition condition, double value, double threshold) const;
+    std::string valueText(const TagDatabase& source, TagRef ref) const;
+    size_t findRung(const std::string& name) const; // SIZE_MAX if there is no such rung
+    std::string rungName(size_t rung) const;
+};
+
+#endif // DEBUGGER_H
@@ -0,0 +1,472 @@
+#ifndef EMBEDDED_PROGRAM_H
+#define EMBEDDED_PROGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "TagDatabase.h"
+
+// Programs compiled into the executable. The variables and logic are string literals in the same format as the
+// variables and logic files; the compiler parses and checks them and emits read-only tables of tags, routines, rungs
+// and tokens. A program with a mistake does not compile:
+//
+//   using Tank = embedded::Program<"VAR level REAL 0 ...", "001 ADD(level,inflow,level) ...">;
+//   Tank::view().loadTags(tags);
+//   LadderLogicParser parser(Tank::view(), tags);
+//
+// Only text parsing and checking move to compile time. The parser builds its rungs, operand references and
+// handler bindings from the tables at startup as usual, in RAM, and runs them with the same engine as a program
+// loaded from files.
+namespace embedded {
+
+// Called while compiling a program only when it has a mistake. They are not constexpr, so the compiler stops with
+// "call to non-constexpr function" naming the mistake, and the evaluation trace points at the offending text.
+namespace compileError {
+void unknownDataType();
+void badTypeMember();
+void tagDeclaredTwice();
+void badArraySize();
+void unknownInstruction();
+void missingParenthesis();
+void branchNotClosed();
+void branchOutsideBST();
+void undeclaredTag();
+void unknownStructMember();
+void unknownMessageOperation();
+void missingLabel();
+void missingSubroutine();
+}
+
+// A string literal as a template argument
+template <size_t N>
+struct FixedString {
+    char text[N]{};
+
+    consteval FixedString(const char (&literal)[N]) { std::copy_n(literal, N, text); }
+    constexpr std::string_view view() const { return {text, N - 1}; }
+};
+
+struct TypeEntry {
+    std::string_view name;
+    uint32_t firstMember = 0;
+    uint32_t memberCount = 0;
+};
+
+struct MemberEntry {
+    std::string_view name;
+    DataType type = DataType::BOOL;
+};
+
+struct TagEntry {
+    std::string_view name;
+    std::string_view typeName; // the structured type of a STRUCT tag
+    DataType type = DataType::BOOL;
+    uint32_t count = 1;
+    std::string_view initialValue;
+};
+
+struct RoutineEntry {
+    std::string_view name;
+    uint32_t firstRung = 0;
+};
+
+struct RungEntry {
+    std::string_view number;
+    uint32_t firstToken = 0;
+    uint32_t tokenCount = 0;
+};
+
+struct Counts {
+    size_t types = 0;
+    size_t members = 0;
+    size_t tags = 0;
+    size_t routines = 0;
+    size_t rungs = 0;
+    size_t tokens = 0;
+};
+
+template <Counts C>
+struct Tables {
+    std::array<TypeEntry, C.types> types{};
+    std::array<MemberEntry, C.members> members{};
+    std::array<TagEntry, C.tags> tags{};
+    std::array<RoutineEntry, C.routines> routines{}; // subroutines, the main program is every rung before the first
+    std::array<RungEntry, C.rungs> rungs{};
+    std::array<std::string_view, C.tokens> tokens{};
+};
+
+// The tables of a compiled program, whatever its size
+struct ProgramView {
+    std::span<const TypeEntry> types;
+    std::span<const MemberEntry> members;
+    std::span<const TagEntry> tags;
+    std::span<const RoutineEntry> routines;
+    std::span<const RungEntry> rungs;
+    std::span<const std::string_view> tokens;
+
+    // Declares the program's types and tags and lays out the image
+    void loadTags(TagDatabase& database) const {
+        for (const auto& type : types) {
+            std::vector<std::pair<std::string, DataType>> list;
+            for (const auto& member : members.subspan(type.firstMember, type.memberCount)) {
+                list.emplace_back(member.name, member.type);
+            }
+            database.defineStruct(std::string(type.name), list);
+        }
+        for (const auto& tag : tags) {
+            uint16_t structType = 0;
+            if (tag.type == DataType::STRUCT) {
+                database.findStruct(std::string(tag.typeName), structType);
+            }
+            database.declare(std::string(tag.name), tag.type, std::string(tag.initialValue), structType, tag.count);
+        }
+        database.layout();
+    }
+};
+
+namespace detail {
+
+constexpr bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+constexpr bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Whitespace separated words of one line
+class Words {
+public:
+    constexpr explicit Words(std::string_view line) : rest(line) {}
+
+    constexpr std::string_view next() {
+        size_t start = 0;
+        while (start < rest.size() && isSpace(rest[start])) {
+            ++start;
+        }
+        size_t end = start;
+        while (end < rest.size() && !isSpace(rest[end])) {
+            ++end;
+        }
+        std::string_view word = rest.substr(start, end - start);
+        rest = rest.substr(end);
+        return word;
+    }
+
+private:
+    std::string_view rest;
+};
+
+template <typename Function>
+constexpr void forEachLine(std::string_view text, Function function) {
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        function(text.substr(0, newline));
+        text = newline == std::string_view::npos ? std::string_view() : text.substr(newline + 1);
+    }
+}
+
+// Walks the program the way TagDatabase::loadFromFile and LadderLogicParser::compileLogic read it
+template <typename Sink>
+consteval void walk(std::string_view variables, std::string_view logic, Sink& sink) {
+    forEachLine(variables, [&sink](std::string_view line) {
+        Words words(line);
+        std::string_view name = words.next();
+        if (name == "TYPE") {
+            sink.type(words.next());
+            for (std::string_view member = words.next(); !member.empty(); member = words.next()) {
+                size_t colon = member.find(':');
+                if (colon == std::string_view::npos) {
+                    compileError::badTypeMember();
+                }
+                sink.member(member.substr(0, colon), member.substr(colon + 1));
+            }
+            return;
+        }
+        if (name == "VAR") {
+            name = words.next();
+        }
+        std::string_view typeName = words.next();
+        std::string_view value = words.next();
+        if (name.empty()) {
+            return;
+        }
+
+        // Arrays are written REAL[1024]
+        uint32_t count = 1;
+        size_t bracket = typeName.find('[');
+        if (bracket != std::string_view::npos) {
+            count = 0;
+            for (size_t i = bracket + 1; i < typeName.size() && typeName[i] != ']'; ++i) {
+                if (!isDigit(typeName[i])) {
+                    compileError::badArraySize();
+                }
+                count = count * 10 + (typeName[i] - '0');
+            }
+            typeName = typeName.substr(0, bracket);
+        }
+        sink.tag(name, typeName, count, value);
+    });
+
+    bool endFound = false;
+    forEachLine(logic, [&sink, &endFound](std::string_view line) {
+        if (endFound) {
+            return;
+        }
+        Words words(line);
+        std::string_view first = words.next();
+        if (first == "SBR") {
+            sink.routine(words.next());
+            return;
+        }
+        if (first.empty() || !isDigit(first[0])) {
+            return;
+        }
+        sink.rung(first);
+        for (std::string_view token = words.next(); !token.empty(); token = words.next()) {
+            // END finishes the program, nothing after it is compiled
+            if (token.substr(0, 3) == "END") {
+                endFound = true;
+                break;
+            }
+            sink.token(token);
+        }
+    });
+}
+
+struct Counter {
+    Counts counts;
+
+    constexpr void type(std::string_view) { ++counts.types; }
+    constexpr void member(std::string_view, std::string_view) { ++counts.members; }
+    constexpr void tag(std::string_view, std::string_view, uint32_t, std::string_view) { ++counts.tags; }
+    constexpr void routine(std::string_view) { ++counts.routines; }
+    constexpr void rung(std::string_view) { ++counts.rungs; }
+    constexpr void token(std::string_view) { ++counts.tokens; }
+};
+
+constexpr bool findDataType(std::string_view name, DataType& type) {
+    for (const auto& entry : dataTypeNames) {
+        if (entry.name == name) {
+            type = entry.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <Counts C>
+struct Filler {
+    Tables<C> tables;
+    Counts filled;
+
+    constexpr void type(std::string_view name) {
+        tables.types[filled.types++] = TypeEntry{name, static_cast<uint32_t>(filled.members), 0};
+    }
+
+    constexpr void member(std::string_view name, std::string_view typeName) {
+        MemberEntry& member = tables.members[filled.members++];
+        member.name = name;
+        if (!findDataType(typeName, member.type)) {
+            compileError::badTypeMember();
+        }
+        ++tables.types[filled.types - 1].memberCount;
+    }
+
+    constexpr void tag(std::string_view name, std::string_view typeName, uint32_t count, std::string_view value) {
+        if (findTag(name) != nullptr) {
+            compileError::tagDeclaredTwice();
+        }
+        TagEntry& tag = tables.tags[filled.tags++];
+        tag = TagEntry{name, typeName, DataType::STRUCT, count, value};
+        if (findStruct(typeName) < 0 && !findDataType(typeName, tag.type)) {
+            compileError::unknownDataType();
+        }
+        if (count == 0 || (count != 1 && (tag.type == DataType::BOOL || tag.type == DataType::STRUCT))) {
+            compileError::badArraySize();
+        }
+    }
+
+    constexpr void routine(std::string_view name) { tables.routines[filled.routines++] = RoutineEntry{name, static_cast<uint32_t>(filled.rungs)}; }
+    constexpr void rung(std::string_view number) { tables.rungs[filled.rungs++] = RungEntry{number, static_cast<uint32_t>(filled.tokens), 0}; }
+
+    constexpr void token(std::string_view text) {
+        tables.tokens[filled.tokens++] = text;
+        ++tables.rungs[filled.rungs - 1].tokenCount;
+    }
+
+    constexpr const TagEntry* findTag(std::string_view name) const {
+        for (size_t i = 0; i < filled.tags; ++i) {
+            if (tables.tags[i].name == name) {
+                return &tables.tags[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // -1 if none, user types count on from the built-in ones
+    constexpr int findStruct(std::string_view name) const {
+        for (size_t i = 0; i < std::size(builtInStructs); ++i) {
+            if (builtInStructs[i].name == name) {
+                return i;
+            }
+        }
+        for (size_t i = 0; i < filled.types; ++i) {
+            if (tables.types[i].name == name) {
+                return std::size(builtInStructs) + i;
+            }
+        }
+        return -1;
+    }
+
+    constexpr bool hasMember(std::string_view typeName, std::string_view memberName) const {
+        int type = findStruct(typeName);
+        if (type >= 0 && static_cast<size_t>(type) < std::size(builtInStructs)) {
+            return std::any_of(builtInStructs[type].members.begin(), builtInStructs[type].members.end(),
+                               [memberName](const BuiltInMember& member) { return member.name == memberName; });
+        }
+        const TypeEntry& user = tables.types[type - std::size(builtInStructs)];
+        for (size_t i = user.firstMember; i < user.firstMember + user.memberCount; ++i) {
+            if (tables.members[i].name == memberName) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // "tag", "tag.MEMBER", "array[i]" or "array[first:end]"
+    constexpr void checkOperand(std::string_view operand) const {
+        size_t end = std::min(operand.find('.'), operand.find('['));
+        const TagEntry* tag = findTag(operand.substr(0, end));
+        if (tag == nullptr) {
+            compileError::undeclaredTag();
+        }
+        if (end != std::string_view::npos && operand[end] == '.' && (tag->type != DataType::STRUCT || !hasMember(tag->typeName, operand.substr(end + 1)))) {
+            compileError::unknownStructMember();
+        }
+    }
+
+    constexpr void checkInstruction(std::string_view token, std::string_view opcode) const {
+        constexpr std::string_view known[] = {"XIC", "XIO", "OTE", "OTL", "AFI", "ADD", "SUB", "LSS", "GTR", "EQU", "NEQ",
+                                              "CTU", "CTD", "TON", "TOF", "ONR", "ONF", "FAD", "FSB", "FMU", "FDV", "FGR",
+                                              "FLS", "FEQ", "COP", "FLL", "PID", "JSR", "RET", "JMP", "LBL", "MCR", "MSG"};
+        if (std::find(std::begin(known), std::end(known), opcode) == std::end(known)) {
+            compileError::unknownInstruction();
+        }
+        if (token.size() > 3 && (token[3] != '(' || token.back() != ')')) {
+            compileError::missingParenthesis();
+        }
+
+        // Routine and label names, MSG keywords and element counts are not tags
+        if (opcode == "JSR" || opcode == "RET" || opcode == "JMP" || opcode == "LBL" || opcode == "MCR" || token.size() <= 3) {
+            return;
+        }
+        std::string_view params = token.substr(4, token.size() - 5);
+        for (size_t index = 0; !params.empty() || index == 0; ++index) {
+            size_t comma = params.find(',');
+            std::string_view operand = params.substr(0, comma);
+            params = comma == std::string_view::npos ? std::string_view() : params.substr(comma + 1);
+            if (opcode == "MSG" && index == 1) {
+                if (operand != "READ" && operand != "WRITE" && operand != "SEND" && operand != "RECEIVE") {
+                    compileError::unknownMessageOperation();
+                }
+            } else if (!(opcode == "MSG" && index == 2) && !operand.empty() && !isDigit(operand[0])) {
+                checkOperand(operand);
+            }
+            if (comma == std::string_view::npos) {
+                break;
+            }
+        }
+    }
+
+    constexpr std::string_view params(std::string_view token) const { return token.size() > 3 ? token.substr(4, token.size() - 5) : token.substr(3); }
+
+    // Once everything is known: instructions, operands, branches, jump labels and called routines
+    constexpr void check() const {
+        for (size_t r = 0; r < filled.rungs; ++r) {
+            const RungEntry& rung = tables.rungs[r];
+            int depth = 0;
+            for (size_t t = rung.firstToken; t < rung.firstToken + rung.tokenCount; ++t) {
+                std::string_view token = tables.tokens[t];
+                std::string_view opcode = token.substr(0, 3);
+                if (opcode == "BST") {
+                    ++depth;
+                } else if (opcode == "NXB" || opcode == "BND") {
+                    if (depth == 0) {
+                        compileError::branchOutsideBST();
+                    }
+                    depth -= opcode == "BND";
+                } else {
+                    checkInstruction(token, opcode);
+                    if (opcode == "JMP" && !hasLabel(r, params(token))) {
+                        compileError::missingLabel();
+                    }
+                    if (opcode == "JSR" && std::none_of(tables.routines.begin(), tables.routines.begin() + filled.routines,
+                                                        [this, &token](const RoutineEntry& routine) { return routine.name == params(token); })) {
+                        compileError::missingSubroutine();
+                    }
+                }
+            }
+            if (depth != 0) {
+                compileError::branchNotClosed();
+            }
+        }
+    }
+
+    // Labels belong to the routine of the rung that jumps
+    constexpr bool hasLabel(size_t rung, std::string_view label) const {
+        size_t first = 0;
+        size_t end = filled.rungs;
+        for (size_t i = 0; i < filled.routines; ++i) {
+            if (tables.routines[i].firstRung <= rung) {
+                first = tables.routines[i].firstRung;
+            } else {
+                end = std::min<size_t>(end, tables.routines[i].firstRung);
+            }
+        }
+        for (size_t r = first; r < end; ++r) {
+            for (size_t t = tables.rungs[r].firstToken; t < tables.rungs[r].firstToken + tables.rungs[r].tokenCount; ++t) {
+                if (tables.tokens[t].substr(0, 3) == "LBL" && params(tables.tokens[t]) == label) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+template <Counts C>
+consteval Tables<C> build(std::string_view variables, std::string_view logic) {
+    Filler<C> filler{};
+    walk(variables, logic, filler);
+    filler.check();
+    return filler.tables;
+}
+
+consteval Counts count(std::string_view variables, std::string_view logic) {
+    Counter counter{};
+    walk(variables, logic, counter);
+    return counter.counts;
+}
+
+}
+
+template <FixedString Variables, FixedString Logic>
+struct Program {
+    static constexpr Counts counts = detail::count(Variables.view(), Logic.view());
+    static constexpr Tables<counts> tables = detail::build<counts>(Variables.view(), Logic.view());
+
+    static constexpr ProgramView view() {
+        return ProgramView{tables.types, tables.members, tables.tags, tables.routines, tables.rungs, tables.tokens};
+    }
+};
+
+}
+
+#endif // EMBEDDED_PROGRAM_H
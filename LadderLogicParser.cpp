@@ -2,28 +2,45 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
-#include <stack>
 #include <thread>
 #include <chrono>
 #include <cmath>
 #include <functional>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <type_traits>
+#include "AlarmEngine.h"
+#include "BulkKernels.h"
+#include "Debugger.h"
+#include "EmbeddedProgram.h"
+#include "ScanJournal.h"
+#include "TagPublisher.h"
 
 LadderLogicParser::LadderLogicParser(
     const std::vector<std::string>& logic,
-    std::map<std::string, Variable>& variableMap
+    TagDatabase& tags
     ) :
     logic(logic),
-    variableMap(variableMap),
-    lineState(true),
-    endFound(false) 
+    tags(tags),
+    pidEngine(tags),
+    messages(tags),
+    lineState(true)
     {
     initializeInstructionHandlers();
+    compileLogic();
 }
 
 std::string boolToString(bool value) {
     return value ? "true" : "false";
 }
 
+void LadderLogicParser::setVirtualClock(int tickMicroseconds) {
+    virtualClock = true;
+    virtualTick = tickMicroseconds;
+    scanTime = tickMicroseconds;
+}
+
 double LadderLogicParser::roundToTwoDecimals(double value) {
     return std::round(value * 100.0) / 100.0;
 }
@@ -34,575 +51,1620 @@ void LadderLogicParser::parseAndExecute() {
     executeLogic();
 }
 
-void LadderLogicParser::executeLogic() {
-    using namespace std::chrono;
+LadderLogicParser::LadderLogicParser(const embedded::ProgramView& program, TagDatabase& tags) :
+    tags(tags),
+    pidEngine(tags),
+    messages(tags),
+    lineState(true)
+    {
+    initializeInstructionHandlers();
 
-    auto start = high_resolution_clock::now();
-    
+    // The program was split into rungs and checked when it was compiled, only the rungs are built here
+    ProgramSource source;
+    source.routines.push_back(Routine{"main", 0, 0});
+    for (const auto& routine : program.routines) {
+        source.routines.back().endRung = routine.firstRung;
+        source.routines.push_back(Routine{std::string(routine.name), routine.firstRung, 0});
+    }
+    source.routines.back().endRung = program.rungs.size();
+    for (const auto& rung : program.rungs) {
+        source.rungs.push_back(RungSource{std::string(rung.number), {}, {}, 0});
+        for (const auto& token : program.tokens.subspan(rung.firstToken, rung.tokenCount)) {
+            source.rungs.back().tokens.emplace_back(token);
+            source.rungs.back().text += (source.rungs.back().text.empty() ? "" : " ") + source.rungs.back().tokens.back();
+        }
+    }
+    for (size_t i = 0; i < source.routines.size(); ++i) {
+        for (size_t r = source.routines[i].firstRung; r < source.routines[i].endRung; ++r) {
+            source.rungs[r].routine = i;
+        }
+    }
+    compileProgram(source);
+}
+
+ProgramSource LadderLogicParser::splitLogic(const std::vector<std::string>& logic) {
+    ProgramSource source;
+    source.routines.push_back(Routine{"main", 0, 0});
     for (const auto& line : logic) {
-        
         std::istringstream iss(line);
         std::string token;
         iss >> token;
 
+        // "SBR name" starts a subroutine, the rungs up to the next SBR or END belong to it
+        if (token == "SBR") {
+            std::string name;
+            iss >> name;
+            source.routines.back().endRung = source.rungs.size();
+            source.routines.push_back(Routine{name, source.rungs.size(), 0});
+            continue;
+        }
+
         // Skip lines that do not start with a number
-        if (!isdigit(token[0])) {
+        if (token.empty() || !isdigit(token[0])) {
             continue;
         }
 
-        std::vector<std::string> tokens;
+        RungSource rung;
+        rung.number = token;
+        rung.routine = source.routines.size() - 1;
+        bool endFound = false;
         while (iss >> token) {
-            tokens.push_back(token);
+            // END finishes the program, nothing after it is compiled
+            if (token.substr(0, 3) == "END") {
+                endFound = true;
+                break;
+            }
+            rung.tokens.push_back(token);
+            rung.text += (rung.text.empty() ? "" : " ") + token;
+        }
+        source.rungs.push_back(std::move(rung));
+        if (endFound) {
+            break;
+        }
+    }
+    source.routines.back().endRung = source.rungs.size();
+    return source;
+}
+
+void LadderLogicParser::compileLogic() {
+    ProgramSource source = splitLogic(logic);
+    compileProgram(source);
+}
+
+void LadderLogicParser::compileProgram(const ProgramSource& source) {
+    // Normally done by loadFromFile, but without a variables file the tags used by the logic still need a place
+    tags.layout();
+
+    routines = source.routines;
+    for (const auto& rung : source.rungs) {
+        rungs.push_back(compileRung(rung));
+    }
+
+    resolveProgramStructure();
+    findSharedPrefixes();
+    pidEngine.reserve();
+    messages.start();
+}
+
+Rung LadderLogicParser::compileRung(const RungSource& source) {
+    Rung rung;
+    rung.number = source.number;
+    rung.source = source.text;
+    size_t position = 0;
+    rung.root = compileSeries(rung, source.tokens, position, 0);
+    rung.mcr = std::any_of(rung.instructions.begin(), rung.instructions.end(), [](const Instruction& instruction) { return instruction.opcode == "MCR"; });
+
+    // The read-only prefixes other rungs may share, found again on every reload
+    const RungNode& root = rung.nodes[rung.root];
+    std::string text;
+    for (size_t i = 0; i < root.childCount; ++i) {
+        const RungNode& child = rung.nodes[rung.children[root.firstChild + i]];
+        if (!child.readOnly) {
+            break;
+        }
+        text += (i > 0 ? " " : "") + nodeText(rung, child);
+        rung.prefixes.push_back(text);
+    }
+    return rung;
+}
+
+void LadderLogicParser::requestReload(const std::vector<std::string>& logic) {
+    // Splitting the text is the slow part for a large program, it is done here rather than on the scan thread
+    ProgramSource source = splitLogic(logic);
+    std::lock_guard<std::mutex> lock(reloadMutex);
+    pendingReload = std::move(source);
+    reloadPending.store(true, std::memory_order_release);
+}
+
+bool LadderLogicParser::reload(const std::vector<std::string>& logic) {
+    ProgramSource source = splitLogic(logic);
+    return applyReload(source);
+}
+
+bool LadderLogicParser::applyReload(ProgramSource& source) {
+    auto started = std::chrono::steady_clock::now();
+    ReloadSummary summary;
+    auto name = [](const std::vector<Routine>& routineList, size_t routine, const std::string& number) {
+        return routineList[routine].name + "/" + number;
+    };
+    std::vector<size_t> routineOf(rungs.size());
+    for (size_t routine = 0; routine < routines.size(); ++routine) {
+        std::fill(routineOf.begin() + routines[routine].firstRung, routineOf.begin() + routines[routine].endRung, routine);
+    }
+
+    // Match each new rung to the running rung of the same routine and number. Most of a program is where it was,
+    // shifted by the rungs added or removed before it, so the lookup table is only built when that guess fails.
+    std::vector<uint8_t> taken(rungs.size(), 0);
+    auto sameRung = [&](size_t old, const RungSource& rung) {
+        return !taken[old] && rungs[old].number == rung.number && routines[routineOf[old]].name == source.routines[rung.routine].name;
+    };
+    std::unordered_map<std::string_view, std::vector<size_t>> byNumber;
+    ptrdiff_t shift = 0;
+
+    // Compile the new and edited rungs aside, the running program is untouched until they all compiled
+    std::vector<size_t> reuse(source.rungs.size(), SIZE_MAX);
+    std::vector<size_t> moved(rungs.size(), SIZE_MAX); // where each running rung ends up, an edited rung counts as moved
+    std::vector<std::pair<size_t, Rung>> compiled;
+    reloading = true;
+    reloadErrors = 0;
+    for (size_t r = 0; r < source.rungs.size(); ++r) {
+        const RungSource& rung = source.rungs[r];
+        size_t old = SIZE_MAX;
+        size_t guess = r + shift;
+        if (guess < rungs.size() && sameRung(guess, rung)) {
+            old = guess;
+        } else {
+            if (byNumber.empty()) {
+                for (size_t i = 0; i < rungs.size(); ++i) {
+                    byNumber[rungs[i].number].push_back(i);
+                }
+            }
+            auto it = byNumber.find(rung.number);
+            if (it != byNumber.end()) {
+                auto candidate = std::find_if(it->second.begin(), it->second.end(), [&](size_t i) { return sameRung(i, rung); });
+                if (candidate != it->second.end()) {
+                    old = *candidate;
+                    shift = static_cast<ptrdiff_t>(old) - static_cast<ptrdiff_t>(r);
+                }
+            }
+        }
+
+        if (old != SIZE_MAX) {
+            taken[old] = 1;
+            moved[old] = r;
+            if (rungs[old].source == rung.text) {
+                reuse[r] = old;
+                ++summary.unchanged;
+                continue;
+            }
+            summary.changed.push_back(name(source.routines, rung.routine, rung.number));
+        } else {
+            summary.added.push_back(name(source.routines, rung.routine, rung.number));
+        }
+        compiled.emplace_back(r, compileRung(rung));
+    }
+    reloading = false;
+    for (size_t old = 0; old < rungs.size(); ++old) {
+        if (!taken[old]) {
+            summary.removed.push_back(name(routines, routineOf[old], rungs[old].number));
+        }
+    }
+    if (reloadErrors > 0) {
+        std::cerr << "Reload rejected, " << reloadErrors << " error(s) in the changed rungs, the running program is unchanged" << std::endl;
+        lastReload = summary;
+        return false;
+    }
+    for (auto& [r, rung] : compiled) {
+        for (auto& instruction : rung.instructions) {
+            registerPidLoop(instruction);
+        }
+    }
+
+    // Jump targets are rung indexes, they only need resolving again if rungs moved or a jump, label or call changed
+    auto programControl = [](const Rung& rung) {
+        return std::any_of(rung.instructions.begin(), rung.instructions.end(), [](const Instruction& instruction) {
+            return instruction.opcode == "JMP" || instruction.opcode == "LBL" || instruction.opcode == "JSR";
+        });
+    };
+    bool inPlace = rungs.size() == source.rungs.size() && routines.size() == source.routines.size();
+    for (size_t old = 0; old < rungs.size() && inPlace; ++old) {
+        inPlace = moved[old] == old;
+    }
+    for (size_t i = 0; i < routines.size() && inPlace; ++i) {
+        inPlace = routines[i].name == source.routines[i].name && routines[i].firstRung == source.routines[i].firstRung;
+    }
+    bool jumpsChanged = !inPlace;
+
+    // Shared prefixes only need finding again if a prefix became shared by two rungs or stopped being shared
+    std::vector<const Rung*> edited;
+    for (size_t old = 0; old < rungs.size(); ++old) {
+        if (moved[old] == SIZE_MAX || reuse[moved[old]] != old) {
+            edited.push_back(&rungs[old]);
+        }
+    }
+    size_t removedCount = edited.size();
+    for (const auto& entry : compiled) {
+        edited.push_back(&entry.second);
+    }
+    std::unordered_map<std::string_view, bool> wasShared;
+    for (const Rung* rung : edited) {
+        jumpsChanged = jumpsChanged || programControl(*rung);
+        for (const auto& text : rung->prefixes) {
+            auto it = prefixRungCount.find(text);
+            wasShared.try_emplace(text, it != prefixRungCount.end() && it->second >= 2);
+        }
+    }
+    for (size_t i = 0; i < edited.size(); ++i) {
+        countPrefixes(*edited[i], i < removedCount ? -1 : 1);
+    }
+    bool sharingChanged = std::any_of(wasShared.begin(), wasShared.end(), [this](const auto& entry) {
+        auto it = prefixRungCount.find(entry.first);
+        return (it != prefixRungCount.end() && it->second >= 2) != entry.second;
+    });
+
+    // Splice: unchanged rungs keep their compiled form, edited ones are swapped for the new compilation
+    if (inPlace) {
+        for (auto& [r, rung] : compiled) {
+            rungs[r] = std::move(rung);
+        }
+    } else {
+        std::vector<Rung> spliced(source.rungs.size());
+        for (size_t r = 0; r < source.rungs.size(); ++r) {
+            if (reuse[r] != SIZE_MAX) {
+                spliced[r] = std::move(rungs[reuse[r]]);
+            }
+        }
+        for (auto& [r, rung] : compiled) {
+            spliced[r] = std::move(rung);
+        }
+        rungs = std::move(spliced);
+        routines = std::move(source.routines);
+    }
+
+    if (jumpsChanged) {
+        resolveProgramStructure();
+    }
+    if (sharingChanged) {
+        findSharedPrefixes();
+    } else {
+        size_t known = sharedPrefixes.size();
+        for (const auto& entry : compiled) {
+            Rung& rung = rungs[entry.first];
+            assignSharedPrefix(rung);
+            for (auto& instruction : rung.instructions) {
+                linkInstruction(instruction, 0, known);
+            }
+        }
+        for (size_t p = known; p < sharedPrefixes.size(); ++p) {
+            linkPrefix(p);
+        }
+    }
+    pidEngine.reserve();
+    if (debugger) {
+        debugger->programChanged(moved);
+    }
+
+    summary.applied = true;
+    summary.microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+    printReload(summary);
+    lastReload = std::move(summary);
+    return true;
+}
+
+void LadderLogicParser::printReload(const ReloadSummary& summary) {
+    std::cout << "Reload applied in " << summary.microseconds << " us: " << summary.added.size() << " added, " << summary.changed.size()
+              << " changed, " << summary.removed.size() << " removed, " << summary.unchanged << " unchanged" << std::endl;
+    for (const auto& name : summary.added) {
+        std::cout << "  added   " << name << std::endl;
+    }
+    for (const auto& name : summary.changed) {
+        std::cout << "  changed " << name << std::endl;
+    }
+    for (const auto& name : summary.removed) {
+        std::cout << "  removed " << name << std::endl;
+    }
+}
+
+void LadderLogicParser::resolveProgramStructure() {
+    for (const auto& routine : routines) {
+        // Labels are local to their routine
+        std::map<std::string, size_t> labels;
+        for (size_t r = routine.firstRung; r < routine.endRung; ++r) {
+            for (const auto& instruction : rungs[r].instructions) {
+                if (instruction.opcode == "LBL" && !labels.emplace(instruction.params, r).second) {
+                    std::cerr << "Rung " << rungs[r].number << ": label " << instruction.params << " is already used in " << routine.name << std::endl;
+                }
+            }
+        }
+
+        for (size_t r = routine.firstRung; r < routine.endRung; ++r) {
+            for (auto& instruction : rungs[r].instructions) {
+                if (instruction.opcode == "JMP") {
+                    instruction.target = SIZE_MAX;
+                    auto it = labels.find(instruction.params);
+                    if (it == labels.end()) {
+                        std::cerr << "Rung " << rungs[r].number << ": no label " << instruction.params << " in " << routine.name << ", JMP does nothing" << std::endl;
+                    } else {
+                        instruction.target = it->second;
+                    }
+                } else if (instruction.opcode == "JSR") {
+                    instruction.target = SIZE_MAX;
+                    auto it = std::find_if(routines.begin() + 1, routines.end(), [&instruction](const Routine& called) { return called.name == instruction.params; });
+                    if (it == routines.end()) {
+                        std::cerr << "Rung " << rungs[r].number << ": no subroutine " << instruction.params << ", JSR does nothing" << std::endl;
+                    } else {
+                        instruction.target = it - routines.begin();
+                    }
+                }
+            }
         }
+    }
+}
 
-        lineState = true; // Reset line state for each new line
-        std::cout << "| ===  ";
-        handleTokens(tokens);
-        std::cout << "|" << std::endl;
+void LadderLogicParser::findSharedPrefixes() {
+    // Count how many rungs start with each read-only prefix
+    prefixRungCount.clear();
+    for (const auto& rung : rungs) {
+        countPrefixes(rung, 1);
     }
 
+    // Each rung reuses the longest prefix it shares with another rung, if it is worth caching
+    sharedPrefixes.clear();
+    prefixIndex.clear();
+    for (auto& rung : rungs) {
+        rung.sharedPrefix = SIZE_MAX;
+        rung.sharedPrefixLength = 0;
+        for (auto& instruction : rung.instructions) {
+            instruction.invalidates.clear();
+        }
+        assignSharedPrefix(rung);
+    }
+
+    // Any instruction that writes an input of a shared prefix invalidates its cached result
+    for (auto& rung : rungs) {
+        for (auto& instruction : rung.instructions) {
+            linkInstruction(instruction, 0, sharedPrefixes.size());
+        }
+    }
+}
+
+void LadderLogicParser::countPrefixes(const Rung& rung, int change) {
+    for (const auto& text : rung.prefixes) {
+        auto it = prefixRungCount.emplace(text, 0).first;
+        it->second += change;
+        if (it->second == 0) {
+            prefixRungCount.erase(it);
+        }
+    }
+}
+
+void LadderLogicParser::assignSharedPrefix(Rung& rung) {
+    const RungNode& root = rung.nodes[rung.root];
+    for (size_t length = rung.prefixes.size(); length > 0; --length) {
+        const std::string& text = rung.prefixes[length - 1];
+        auto count = prefixRungCount.find(text);
+        if (count == prefixRungCount.end() || count->second < 2) {
+            continue;
+        }
+
+        SharedPrefix prefix;
+        prefix.text = text;
+        for (size_t i = 0; i < length; ++i) {
+            collectInputs(rung, rung.nodes[rung.children[root.firstChild + i]], prefix.inputs, prefix.instructionCount);
+        }
+        // A single contact is as cheap as looking up the cached result
+        if (prefix.instructionCount < 2 && text.substr(0, 3) != "LSS" && text.substr(0, 3) != "GTR" && text.substr(0, 3) != "EQU" && text.substr(0, 3) != "NEQ") {
+            break;
+        }
+
+        auto it = prefixIndex.find(text);
+        if (it == prefixIndex.end()) {
+            it = prefixIndex.emplace(text, sharedPrefixes.size()).first;
+            sharedPrefixes.push_back(prefix);
+        }
+        rung.sharedPrefix = it->second;
+        rung.sharedPrefixLength = length;
+        break;
+    }
+}
+
+void LadderLogicParser::linkInstruction(Instruction& instruction, size_t firstPrefix, size_t endPrefix) {
+    if (instruction.readOnly) {
+        return;
+    }
+    for (size_t p = firstPrefix; p < endPrefix; ++p) {
+        for (size_t o = 0; o < instruction.operands.size(); ++o) {
+            if (!writesOperand(instruction, o)) {
+                continue;
+            }
+            const auto& inputs = sharedPrefixes[p].inputs;
+            const TagRef& output = instruction.operands[o];
+            if (std::any_of(inputs.begin(), inputs.end(), [this, &output](const TagRef& input) { return tags.overlaps(input, output); })) {
+                instruction.invalidates.push_back(p);
+                break;
+            }
+        }
+    }
+}
+
+void LadderLogicParser::linkPrefix(size_t prefix) {
+    for (auto& rung : rungs) {
+        for (auto& instruction : rung.instructions) {
+            linkInstruction(instruction, prefix, prefix + 1);
+        }
+    }
+}
+
+bool LadderLogicParser::writesOperand(const Instruction& instruction, size_t operand) {
+    if (instruction.readOnly || !instruction.operands[operand]) {
+        return false;
+    }
+    // A structured operand is the instruction's control record, which it always updates
+    auto it = instructionHandlers.find(instruction.opcode);
+    unsigned writes = it != instructionHandlers.end() ? it->second.writes : 0;
+    return (writes & (1u << operand)) || instruction.operands[operand].type == DataType::STRUCT;
+}
+
+void LadderLogicParser::setDebugger(Debugger* debugger) {
+    this->debugger = debugger;
+    debugHandler = [this](const Instruction& instruction, bool& currentBranchState) {
+        bool result = (*instruction.originalHandler)(instruction, currentBranchState);
+        this->debugger->afterInstruction(instruction);
+        return result;
+    };
+}
+
+void LadderLogicParser::setJournal(ScanJournal* journal) {
+    this->journal = journal;
+    if (journal) {
+        journal->reserveMessages(messages.size(), messages.bufferBytes());
+    }
+}
+
+void LadderLogicParser::setAlarms(AlarmEngine* alarms) {
+    this->alarms = alarms;
+}
+
+void LadderLogicParser::setPublisher(TagPublisher* publisher) {
+    this->publisher = publisher;
+}
+
+void LadderLogicParser::patchWriters(const std::vector<TagRef>& refs) {
+    for (auto& rung : rungs) {
+        for (auto& instruction : rung.instructions) {
+            bool hooked = false;
+            for (size_t o = 0; o < instruction.operands.size() && !hooked; ++o) {
+                if (writesOperand(instruction, o)) {
+                    hooked = std::any_of(refs.begin(), refs.end(), [this, &instruction, o](const TagRef& ref) {
+                        return tags.overlaps(ref, instruction.operands[o]);
+                    });
+                }
+            }
+
+            if (hooked && !instruction.originalHandler) {
+                instruction.originalHandler = instruction.handler;
+                instruction.handler = &debugHandler;
+            } else if (!hooked && instruction.originalHandler) {
+                instruction.handler = instruction.originalHandler;
+                instruction.originalHandler = nullptr;
+            }
+        }
+    }
+}
+
+std::string LadderLogicParser::nodeText(const Rung& rung, const RungNode& node) {
+    if (node.kind == RungNode::Leaf) {
+        const Instruction& instruction = rung.instructions[node.instruction];
+        return instruction.opcode + "(" + instruction.params + ")";
+    }
+
+    std::string text = node.kind == RungNode::Parallel ? "BST " : "";
+    for (size_t i = 0; i < node.childCount; ++i) {
+        if (i > 0) {
+            text += node.kind == RungNode::Parallel ? " NXB " : " ";
+        }
+        text += nodeText(rung, rung.nodes[rung.children[node.firstChild + i]]);
+    }
+    return node.kind == RungNode::Parallel ? text + " BND" : text;
+}
+
+void LadderLogicParser::collectInputs(const Rung& rung, const RungNode& node, std::vector<TagRef>& inputs, size_t& instructionCount) {
+    if (node.kind == RungNode::Leaf) {
+        ++instructionCount;
+        for (const TagRef& operand : rung.instructions[node.instruction].operands) {
+            if (operand) {
+                inputs.push_back(operand);
+            }
+        }
+        return;
+    }
+    for (size_t i = 0; i < node.childCount; ++i) {
+        collectInputs(rung, rung.nodes[rung.children[node.firstChild + i]], inputs, instructionCount);
+    }
+}
+
+size_t LadderLogicParser::sharedPrefixCount() const {
+    return sharedPrefixes.size();
+}
+
+size_t LadderLogicParser::sharedPrefixRungs() const {
+    size_t count = 0;
+    for (const auto& rung : rungs) {
+        count += rung.sharedPrefix != SIZE_MAX;
+    }
+    return count;
+}
+
+size_t LadderLogicParser::compileSeries(Rung& rung, const std::vector<std::string>& tokens, size_t& position, size_t depth) {
+    RungNode node;
+    node.kind = RungNode::Series;
+    std::vector<size_t> children;
+
+    while (position < tokens.size()) {
+        std::string opcode = tokens[position].substr(0, 3);
+        if (opcode == "NXB" || opcode == "BND") {
+            if (depth > 0) {
+                break;
+            }
+            std::cerr << "Rung " << rung.number << ": " << opcode << " without a branch start, ignored" << std::endl;
+            ++position;
+        } else if (opcode == "BST") {
+            ++position;
+            children.push_back(compileParallel(rung, tokens, position, depth + 1));
+        } else {
+            rung.instructions.push_back(compileInstruction(tokens[position]));
+            RungNode leaf;
+            leaf.kind = RungNode::Leaf;
+            leaf.instruction = rung.instructions.size() - 1;
+            leaf.readOnly = rung.instructions.back().readOnly;
+            rung.nodes.push_back(leaf);
+            children.push_back(rung.nodes.size() - 1);
+            ++position;
+        }
+    }
+
+    for (size_t child : children) {
+        node.readOnly = node.readOnly && rung.nodes[child].readOnly;
+    }
+    node.firstChild = rung.children.size();
+    node.childCount = children.size();
+    rung.children.insert(rung.children.end(), children.begin(), children.end());
+    rung.nodes.push_back(node);
+    return rung.nodes.size() - 1;
+}
+
+size_t LadderLogicParser::compileParallel(Rung& rung, const std::vector<std::string>& tokens, size_t& position, size_t depth) {
+    RungNode node;
+    node.kind = RungNode::Parallel;
+    std::vector<size_t> children;
+
+    while (true) {
+        children.push_back(compileSeries(rung, tokens, position, depth));
+        if (position >= tokens.size()) {
+            std::cerr << "Rung " << rung.number << ": branch is not closed, BND assumed at the end of the rung" << std::endl;
+            break;
+        }
+        std::string opcode = tokens[position++].substr(0, 3);
+        if (opcode == "BND") {
+            break;
+        }
+    }
+
+    for (size_t child : children) {
+        node.readOnly = node.readOnly && rung.nodes[child].readOnly;
+    }
+    node.firstChild = rung.children.size();
+    node.childCount = children.size();
+    rung.children.insert(rung.children.end(), children.begin(), children.end());
+    rung.nodes.push_back(node);
+    return rung.nodes.size() - 1;
+}
+
+Instruction LadderLogicParser::compileInstruction(const std::string& token) {
+    Instruction instruction;
+    instruction.opcode = token.substr(0, 3);
+    instruction.params = (token.length() > 3) ? token.substr(4, token.length() - 5) : "";
+
+    auto it = instructionHandlers.find(instruction.opcode);
+    if (it != instructionHandlers.end()) {
+        instruction.handler = &it->second.execute;
+        instruction.readOnly = it->second.writes == 0 && !it->second.programControl;
+    } else {
+        std::cerr << "Unknown instruction: " << instruction.opcode << std::endl;
+        reloadErrors += reloading;
+        // Unknown instructions do nothing, treat them as read-only so they never block skipping
+        instruction.readOnly = true;
+    }
+
+    if (it != instructionHandlers.end() && it->second.programControl) {
+        // Routine and label names are resolved once the whole program is compiled
+        instruction.operandNames.push_back(instruction.params);
+        return instruction;
+    }
+
+    unsigned literals = it != instructionHandlers.end() ? it->second.literals : 0;
+    std::istringstream paramStream(instruction.params);
+    std::string name;
+    while (std::getline(paramStream, name, ',')) {
+        instruction.operandNames.push_back(name);
+        if (literals & (1u << instruction.operands.size())) {
+            instruction.operands.push_back(TagRef{});
+            continue;
+        }
+        if (!name.empty() && std::isdigit(static_cast<unsigned char>(name[0]))) {
+            // Tag names never start with a digit, this is an element count
+            instruction.length = std::stoul(name);
+            instruction.operands.push_back(TagRef{});
+            continue;
+        }
+        instruction.operands.push_back(name.empty() ? TagRef{} : resolveTag(name));
+    }
+
+    // A reload registers its loops only once the whole change is accepted, registering writes the record
+    if (!reloading) {
+        registerPidLoop(instruction);
+    }
+
+    if (instruction.opcode == "MSG" && reloading) {
+        // The message workers are running and their slots are fixed
+        std::cerr << "MSG cannot be added or edited online: " << instruction.params << std::endl;
+        ++reloadErrors;
+    } else if (instruction.opcode == "MSG") {
+        MessageOperation operation;
+        if (instruction.operands.size() != 4 || !instruction.operands[0] || instruction.operands[0].type != DataType::STRUCT ||
+            instruction.operands[0].structType != TagDatabase::MessageType) {
+            std::cerr << "MSG needs a MESSAGE tag, an operation, a file or address:port and a data tag: " << instruction.params << std::endl;
+        } else if (!MessageExecutor::parseOperation(instruction.operandNames[1], operation)) {
+            std::cerr << "MSG operation is not READ, WRITE, SEND or RECEIVE: " << instruction.operandNames[1] << std::endl;
+        } else {
+            instruction.target = messages.add(operation, instruction.operandNames[2], instruction.operands[3]);
+        }
+    }
+    return instruction;
+}
+
+void LadderLogicParser::registerPidLoop(Instruction& instruction) {
+    if (instruction.opcode == "PID" && hasOperands(instruction, 1) && instruction.operands[0].type == DataType::STRUCT &&
+        instruction.operands[0].structType == TagDatabase::PidType) {
+        instruction.loop = pidEngine.registerLoop(instruction.operands[0]);
+    }
+}
+
+TagRef LadderLogicParser::resolveTag(const std::string& tagName) {
+    TagRef ref = tags.find(tagName);
+    if (!ref && tagName.find('.') != std::string::npos) {
+        std::cerr << "Unknown member of a structured variable: " << tagName << std::endl;
+        reloadErrors += reloading;
+    } else if (!ref && reloading) {
+        // Declaring it would grow the tag image under the running program
+        std::cerr << "Variable not declared: " << tagName << std::endl;
+        ++reloadErrors;
+    } else if (!ref) {
+        std::cerr << "Variable not declared, defaulting to BOOL false: " << tagName << std::endl;
+        tags.declare(tagName, DataType::BOOL, "");
+        ref = tags.find(tagName);
+    }
+    return ref;
+}
+
+void LadderLogicParser::executeLogic() {
+    runScan();
+
+    // The virtual clock ignores how long the scan really took, so results are reproducible
+    if (virtualClock) {
+        simulatedTime += virtualTick;
+    } else {
+        scanTime = executionTime;
+    }
+}
+
+void LadderLogicParser::executeLogic(int elapsedMicroseconds) {
+    scanTime = elapsedMicroseconds;
+    runScan();
+}
+
+void LadderLogicParser::runScan() {
+    using namespace std::chrono;
+
+    // A downloaded program change goes in between two scans
+    if (reloadPending.load(std::memory_order_acquire)) {
+        ProgramSource source;
+        {
+            std::lock_guard<std::mutex> lock(reloadMutex);
+            source = std::move(pendingReload);
+            reloadPending.store(false, std::memory_order_relaxed);
+        }
+        applyReload(source);
+    }
+
+    scanStarted = high_resolution_clock::now();
+    scanClock += scanTime;
+    if (debugger) {
+        debugger->scanStart();
+    }
+    if (journal) {
+        journal->scanStart(scanTime);
+    }
+
+    // Variables may have been changed from outside between scans
+    for (auto& prefix : sharedPrefixes) {
+        prefix.valid = false;
+    }
     
+    jumpTo = SIZE_MAX;
+    if (debugger && debugger->breakpointsActive()) {
+        runRoutine<true>(0);
+    } else {
+        runRoutine<false>(0);
+    }
+
+    // Every PID loop whose rung was true is updated in one pass
+    pidEngine.update(scanClock);
+    // Then every alarm point, on the values the logic left
+    if (alarms) {
+        alarms->update(scanClock);
+    }
+    if (debugger) {
+        debugger->scanEnd();
+    }
+    if (journal) {
+        journal->scanEnd();
+    }
+    if (publisher) {
+        publisher->scanEnd(scanClock);
+    }
+
     // Simulate a delay between scans
     // std::this_thread::sleep_for(milliseconds(1));
     auto end = high_resolution_clock::now();
-    scanTime = duration_cast<microseconds>(end - start).count();
+    executionTime = duration_cast<microseconds>(end - scanStarted).count();
 }
 
-void LadderLogicParser::handleTokens(const std::vector<std::string>& tokens) {
-    std::stack<bool> branchStack;
-    std::stack<bool> currentBranchStateStack;
-    bool branchResult = true;
-    bool currentBranchState = true;
+template <bool Breakpoints>
+void LadderLogicParser::runRoutine(size_t routine) {
+    using namespace std::chrono;
 
-    size_t i = 0;
-    while (i < tokens.size()) {
-        const std::string& instruction = tokens[i];
-        std::string opcode = instruction.substr(0, 3);
-        std::string params = (instruction.length() > 3) ? instruction.substr(4, instruction.length() - 5) : "";
+    const Routine& range = routines[routine];
+    mcrEnergized = true;
+    for (size_t i = range.firstRung; i < range.endRung;) {
+        if constexpr (Breakpoints) {
+            debugger->beforeRung(i);
+        }
 
-        try {
-            if (opcode == "END") {
-                endFound = true;
-                std::cout << "End found, stopping further instructions." << std::endl;
-                return;
-            } else if (opcode == "BST") {
-                handleBranchStart(branchStack, currentBranchStateStack, branchResult, currentBranchState);
-            } else if (opcode == "NXB") {
-                handleNextBranch(branchResult, currentBranchState);
-            } else if (opcode == "BND") {
-                handleBranchEnd(branchStack, currentBranchStateStack, branchResult, currentBranchState);
-            } else {
-                handleInstruction(opcode, params, currentBranchState);
-            }
-        } catch (const std::exception& e) {
-            std::cerr << opcode << " instruction error: " << e.what() << std::endl;
+        const Rung& rung = rungs[i];
+        if (traceEnabled) std::cout << "| ===  ";
+        if (mcrEnergized || rung.mcr) {
+            lineState = evaluateRung(rung);
+        } else {
+            // Inside a switched off MCR zone every rung runs as if its conditions were false
+            const RungNode& root = rung.nodes[rung.root];
+            lineState = evaluateSeries(rung, root, 0, root.childCount, false);
+        }
+        if (traceEnabled) std::cout << "|" << std::endl;
+        ++rungsEvaluated;
+
+        if (jumpTo == SIZE_MAX) {
+            ++i;
+            continue;
+        }
+        if (jumpTo == AbortScan) {
+            break;
+        }
+        if (jumpTo == ReturnFromRoutine) {
+            jumpTo = SIZE_MAX;
+            break;
+        }
+        // Only a backward jump can loop, so only those look at the clock
+        if (jumpTo <= i && duration_cast<microseconds>(high_resolution_clock::now() - scanStarted).count() > watchdogMicroseconds) {
+            std::cerr << "Watchdog: scan still running after " << watchdogMicroseconds << " us, jumping back from rung " << rung.number
+                      << ", the rest of the scan is skipped" << std::endl;
+            jumpTo = AbortScan;
+            break;
+        }
+        i = jumpTo;
+        jumpTo = SIZE_MAX;
+    }
+    mcrEnergized = true;
+}
+
+void LadderLogicParser::callRoutine(size_t routine) {
+    if (callDepth >= 32) {
+        throw std::invalid_argument("Subroutines nested more than 32 deep: " + routines[routine].name);
+    }
+
+    // The caller's MCR zone carries on after the call, and so does a jump or return its rung already asked for
+    bool energized = mcrEnergized;
+    size_t pendingJump = jumpTo;
+    jumpTo = SIZE_MAX;
+    ++callDepth;
+    if (debugger && debugger->breakpointsActive()) {
+        runRoutine<true>(routine);
+    } else {
+        runRoutine<false>(routine);
+    }
+    --callDepth;
+    mcrEnergized = energized;
+    if (jumpTo != AbortScan) {
+        jumpTo = pendingJump;
+    }
+}
+
+bool LadderLogicParser::evaluateRung(const Rung& rung) {
+    const RungNode& root = rung.nodes[rung.root];
+    if (rung.sharedPrefix == SIZE_MAX) {
+        return evaluateSeries(rung, root, 0, root.childCount, true);
+    }
+
+    SharedPrefix& prefix = sharedPrefixes[rung.sharedPrefix];
+    if (prefix.valid) {
+        ++sharedPrefixHits;
+        skippedEvaluations += prefix.instructionCount;
+        if (traceEnabled) std::cout << "{" << prefix.text << "}" << (prefix.value ? " === " : " --- ");
+    } else {
+        prefix.value = evaluateSeries(rung, root, 0, rung.sharedPrefixLength, true);
+        prefix.valid = true;
+    }
+    return evaluateSeries(rung, root, rung.sharedPrefixLength, root.childCount, prefix.value);
+}
+
+bool LadderLogicParser::evaluateSeries(const Rung& rung, const RungNode& node, size_t first, size_t last, bool currentBranchState) {
+    for (size_t i = first; i < last; ++i) {
+        const RungNode& child = rung.nodes[rung.children[node.firstChild + i]];
+        // Once the rung is false, read-only instructions cannot change the result
+        if (!currentBranchState && child.readOnly) {
+            continue;
         }
-        ++i;
+        currentBranchState = evaluateNode(rung, child, currentBranchState);
     }
+    return currentBranchState;
+}
+
+bool LadderLogicParser::evaluateNode(const Rung& rung, const RungNode& node, bool currentBranchState) {
+    if (node.kind == RungNode::Leaf) {
+        handleInstruction(rung.instructions[node.instruction], currentBranchState);
+        return currentBranchState;
+    }
+
+    if (node.kind == RungNode::Series) {
+        return evaluateSeries(rung, node, 0, node.childCount, currentBranchState);
+    }
+
+    // Every branch gets the power coming into the branch start, and the branch end passes on the OR of the branches
+    if (!currentBranchState && node.readOnly) {
+        return false;
+    }
+    if (traceEnabled) std::cout << "<<" << std::endl;
+    bool branchResult = false;
+    for (size_t i = 0; i < node.childCount; ++i) {
+        const RungNode& child = rung.nodes[rung.children[node.firstChild + i]];
+        if (i > 0) {
+            if (traceEnabled) std::cout << "^^" << std::endl;
+        }
+        // Once a branch is true, the remaining read-only branches cannot change the result
+        if (branchResult && child.readOnly) {
+            continue;
+        }
+        branchResult = evaluateNode(rung, child, currentBranchState) || branchResult;
+    }
+    if (traceEnabled) std::cout << ">>" << std::endl;
+    return branchResult;
 }
 
 void LadderLogicParser::initializeInstructionHandlers() {
-    instructionHandlers["XIC"] = std::bind(&LadderLogicParser::handleXicInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["XIO"] = std::bind(&LadderLogicParser::handleXioInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["OTE"] = std::bind(&LadderLogicParser::handleOteInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["OTL"] = std::bind(&LadderLogicParser::handleOtlInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["AFI"] = std::bind(&LadderLogicParser::handleAfiInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["ADD"] = std::bind(&LadderLogicParser::handleAddInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["SUB"] = std::bind(&LadderLogicParser::handleSubInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["LSS"] = std::bind(&LadderLogicParser::handleLssInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["GTR"] = std::bind(&LadderLogicParser::handleGtrInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["EQU"] = std::bind(&LadderLogicParser::handleEquInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["NEQ"] = std::bind(&LadderLogicParser::handleNeqInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["CTU"] = std::bind(&LadderLogicParser::handleCtuInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["CTD"] = std::bind(&LadderLogicParser::handleCtdInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["TON"] = std::bind(&LadderLogicParser::handleTonInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["TOF"] = std::bind(&LadderLogicParser::handleTofInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["ONR"] = std::bind(&LadderLogicParser::handleOnrInstruction, this, std::placeholders::_1, std::placeholders::_2);
-    instructionHandlers["ONF"] = std::bind(&LadderLogicParser::handleOnfInstruction, this, std::placeholders::_1, std::placeholders::_2);
-}
-
-void LadderLogicParser::handleInstruction(const std::string& opcode, const std::string& params, bool& currentBranchState) {
-    auto it = instructionHandlers.find(opcode);
-    if (it != instructionHandlers.end()) {
+    instructionHandlers["XIC"] = {std::bind(&LadderLogicParser::handleXicInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["XIO"] = {std::bind(&LadderLogicParser::handleXioInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["OTE"] = {std::bind(&LadderLogicParser::handleOteInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1};
+    instructionHandlers["OTL"] = {std::bind(&LadderLogicParser::handleOtlInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1};
+    instructionHandlers["AFI"] = {std::bind(&LadderLogicParser::handleAfiInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["ADD"] = {std::bind(&LadderLogicParser::handleAddInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["SUB"] = {std::bind(&LadderLogicParser::handleSubInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["LSS"] = {std::bind(&LadderLogicParser::handleLssInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["GTR"] = {std::bind(&LadderLogicParser::handleGtrInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["EQU"] = {std::bind(&LadderLogicParser::handleEquInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["NEQ"] = {std::bind(&LadderLogicParser::handleNeqInstruction, this, std::placeholders::_1, std::placeholders::_2), 0};
+    instructionHandlers["CTU"] = {std::bind(&LadderLogicParser::handleCtuInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1110};
+    instructionHandlers["CTD"] = {std::bind(&LadderLogicParser::handleCtdInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1110};
+    instructionHandlers["TON"] = {std::bind(&LadderLogicParser::handleTonInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1011};
+    instructionHandlers["TOF"] = {std::bind(&LadderLogicParser::handleTofInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1011};
+    instructionHandlers["ONR"] = {std::bind(&LadderLogicParser::handleOnrInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1};
+    instructionHandlers["ONF"] = {std::bind(&LadderLogicParser::handleOnfInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1};
+    instructionHandlers["FAD"] = {std::bind(&LadderLogicParser::handleFadInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["FSB"] = {std::bind(&LadderLogicParser::handleFsbInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["FMU"] = {std::bind(&LadderLogicParser::handleFmuInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["FDV"] = {std::bind(&LadderLogicParser::handleFdvInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["FGR"] = {std::bind(&LadderLogicParser::handleFgrInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["FLS"] = {std::bind(&LadderLogicParser::handleFlsInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["FEQ"] = {std::bind(&LadderLogicParser::handleFeqInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b100};
+    instructionHandlers["COP"] = {std::bind(&LadderLogicParser::handleCopInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b10};
+    instructionHandlers["FLL"] = {std::bind(&LadderLogicParser::handleFllInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b10};
+    instructionHandlers["PID"] = {std::bind(&LadderLogicParser::handlePidInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1};
+    instructionHandlers["JSR"] = {std::bind(&LadderLogicParser::handleJsrInstruction, this, std::placeholders::_1, std::placeholders::_2), 0, true};
+    instructionHandlers["RET"] = {std::bind(&LadderLogicParser::handleRetInstruction, this, std::placeholders::_1, std::placeholders::_2), 0, true};
+    instructionHandlers["JMP"] = {std::bind(&LadderLogicParser::handleJmpInstruction, this, std::placeholders::_1, std::placeholders::_2), 0, true};
+    instructionHandlers["LBL"] = {std::bind(&LadderLogicParser::handleLblInstruction, this, std::placeholders::_1, std::placeholders::_2), 0, true};
+    instructionHandlers["MCR"] = {std::bind(&LadderLogicParser::handleMcrInstruction, this, std::placeholders::_1, std::placeholders::_2), 0, true};
+    instructionHandlers["MSG"] = {std::bind(&LadderLogicParser::handleMsgInstruction, this, std::placeholders::_1, std::placeholders::_2), 0b1000, false, 0b110};
+}
+
+void LadderLogicParser::handleInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (instruction.handler) {
         try {
-            currentBranchState = currentBranchState && it->second(params, currentBranchState);
+            // Read-only instructions only run while the rung is true, everything else also sees a false rung
+            currentBranchState = (*instruction.handler)(instruction, currentBranchState);
         } catch (const std::exception& e) {
-            std::cerr << "Error executing instruction '" << opcode << "': " << e.what() << std::endl;
+            std::cerr << "Error executing instruction '" << instruction.opcode << "': " << e.what() << std::endl;
         }
     } else {
-        std::cerr << "Unknown instruction: " << opcode << std::endl;
+        std::cerr << "Unknown instruction: " << instruction.opcode << std::endl;
+        reloadErrors += reloading;
+    }
+
+    for (size_t prefix : instruction.invalidates) {
+        sharedPrefixes[prefix].valid = false;
     }
 }
 
-bool LadderLogicParser::handleXicInstruction(const std::string& params, bool& currentBranchState) {
-    if (params.empty()) {
+bool LadderLogicParser::handleXicInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (instruction.operands.empty()) {
         std::cerr << "XIC instruction missing parameters." << std::endl;
         return currentBranchState;
     }
-    bool value = getBoolValue(params);
+    bool value = getBoolValue(instruction, 0);
     currentBranchState = currentBranchState && value;
-    std::cout << "XIC[" << params << "]" << (currentBranchState ? " === " : " --- ");
+    if (traceEnabled) std::cout << "XIC[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleXioInstruction(const std::string& params, bool& currentBranchState) {
-    if (params.empty()) {
+bool LadderLogicParser::handleXioInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (instruction.operands.empty()) {
         std::cerr << "XIO instruction missing parameters." << std::endl;
         return currentBranchState;
     }
-    bool value = !getBoolValue(params);
+    bool value = !getBoolValue(instruction, 0);
     currentBranchState = currentBranchState && value;
-    std::cout << "XIO[" << params << "]" << (currentBranchState ? " === " : " --- ");
+    if (traceEnabled) std::cout << "XIO[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleOteInstruction(const std::string& params, bool& currentBranchState) {
-    if (params.empty()) {
+bool LadderLogicParser::handleOteInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (instruction.operands.empty()) {
         std::cerr << "OTE instruction missing parameters." << std::endl;
         return currentBranchState;
     }
-    setBoolValue(params, currentBranchState);
-    std::cout << "OTE[" << params << "]" << (currentBranchState ? " === " : " --- ");
+    setBoolValue(instruction, 0, currentBranchState);
+    if (traceEnabled) std::cout << "OTE[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleOtlInstruction(const std::string& params, bool& currentBranchState) {
-    if (params.empty()) {
+bool LadderLogicParser::handleOtlInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (instruction.operands.empty()) {
         std::cerr << "OTL instruction missing parameters." << std::endl;
         return currentBranchState;
     }
     if (currentBranchState) {
-        setBoolValue(params, true);
+        setBoolValue(instruction, 0, true);
     }
-    std::cout << "OTL[" << params << "]" << (getBoolValue(params) ? " === " : " --- ");
+    if (traceEnabled) std::cout << "OTL[" << instruction.params << "]" << (getBoolValue(instruction, 0) ? " === " : " --- ");
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleEquInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string var1, var2;
-    std::getline(paramStream, var1, ',');
-    std::getline(paramStream, var2, ',');
-
-    if (var1.empty() || var2.empty()) {
+bool LadderLogicParser::handleEquInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 2)) {
         std::cerr << "EQU instruction has incomplete parameters." << std::endl;
         return false;
     }
 
-    if (variableMap.find(var1) != variableMap.end() && variableMap.find(var2) != variableMap.end()) {
-        bool result;
-        if (std::holds_alternative<int>(variableMap[var1]) && std::holds_alternative<int>(variableMap[var2])) {
-            int val1 = std::get<int>(variableMap[var1]);
-            int val2 = std::get<int>(variableMap[var2]);
-            result = val1 == val2;
-            std::cout << "EQU(" << val1 << " == " << val2 << ")" << (result ? " === " : " --- ");
-        } else if (std::holds_alternative<double>(variableMap[var1]) && std::holds_alternative<double>(variableMap[var2])) {
-            double val1 = roundToTwoDecimals(std::get<double>(variableMap[var1]));
-            double val2 = roundToTwoDecimals(std::get<double>(variableMap[var2]));
-            result = val1 == val2;
-            std::cout << "EQU(" << val1 << " == " << val2 << ")" << (result ? " === " : " --- ");
-        } else {
-            std::cerr << "EQU instruction type mismatch: " << var1 << ", " << var2 << std::endl;
-            return false;
-        }
-        return result;
-    } else {
-        std::cerr << "EQU instruction variables not found: " << var1 << ", " << var2 << std::endl;
-        return false;
+    bool result = compareOperands(instruction, true) == 0;
+    if (traceEnabled) {
+        std::cout << "EQU(";
+        tags.printValue(std::cout, instruction.operands[0]);
+        std::cout << " == ";
+        tags.printValue(std::cout, instruction.operands[1]);
+        std::cout << ")" << (result ? " === " : " --- ");
     }
+    return result;
 }
 
-bool LadderLogicParser::handleAfiInstruction(const std::string& params, bool& currentBranchState) {
+bool LadderLogicParser::handleAfiInstruction(const Instruction& instruction, bool& currentBranchState) {
     currentBranchState = false;
-    std::cout << "AFI" << (currentBranchState ? " === " : " --- ");
+    if (traceEnabled) std::cout << "AFI" << (currentBranchState ? " === " : " --- ");
     return false;
 }
 
 
-bool LadderLogicParser::handleNeqInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string var1, var2;
-    std::getline(paramStream, var1, ',');
-    std::getline(paramStream, var2, ',');
-
-    if (var1.empty() || var2.empty()) {
+bool LadderLogicParser::handleNeqInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 2)) {
         std::cerr << "NEQ instruction has incomplete parameters." << std::endl;
         return false;
     }
 
-    if (variableMap.find(var1) != variableMap.end() && variableMap.find(var2) != variableMap.end()) {
-        bool result;
-        if (std::holds_alternative<int>(variableMap[var1]) && std::holds_alternative<int>(variableMap[var2])) {
-            int val1 = std::get<int>(variableMap[var1]);
-            int val2 = std::get<int>(variableMap[var2]);
-            result = val1 != val2;
-            std::cout << "NEQ(" << val1 << " != " << val2 << ")" << (result ? " === " : " --- ");
-        } else if (std::holds_alternative<double>(variableMap[var1]) && std::holds_alternative<double>(variableMap[var2])) {
-            double val1 = roundToTwoDecimals(std::get<double>(variableMap[var1]));
-            double val2 = roundToTwoDecimals(std::get<double>(variableMap[var2]));
-            result = val1 != val2;
-            std::cout << "NEQ(" << val1 << " != " << val2 << ")" << (result ? " === " : " --- ");
-        } else {
-            std::cerr << "NEQ instruction type mismatch: " << var1 << ", " << var2 << std::endl;
-            return false;
-        }
-        return result;
-    } else {
-        std::cerr << "NEQ instruction variables not found: " << var1 << ", " << var2 << std::endl;
-        return false;
+    bool result = compareOperands(instruction, true) != 0;
+    if (traceEnabled) {
+        std::cout << "NEQ(";
+        tags.printValue(std::cout, instruction.operands[0]);
+        std::cout << " != ";
+        tags.printValue(std::cout, instruction.operands[1]);
+        std::cout << ")" << (result ? " === " : " --- ");
     }
+    return result;
 }
 
-bool LadderLogicParser::handleCtuInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string pre, acc, ct, dn;
-    std::getline(paramStream, pre, ',');
-    std::getline(paramStream, acc, ',');
-    std::getline(paramStream, ct, ',');
-    std::getline(paramStream, dn, ',');
+bool LadderLogicParser::handleCtuInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleCounter(instruction, currentBranchState, true);
+}
 
-    if (pre.empty() || acc.empty() || ct.empty() || dn.empty()) {
-        std::cerr << "CTU instruction has incomplete parameters." << std::endl;
+bool LadderLogicParser::handleCtdInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleCounter(instruction, currentBranchState, false);
+}
+
+bool LadderLogicParser::handleCounter(const Instruction& instruction, bool& currentBranchState, bool countUp) {
+    // CTU(counter) and CTD(counter) keep everything in one COUNTER record
+    if (instruction.operands.size() == 1 && instruction.operands[0].type == DataType::STRUCT) {
+        if (instruction.operands[0].structType != TagDatabase::CounterType) {
+            throw std::invalid_argument("Variable is not a COUNTER: " + instruction.operandNames[0]);
+        }
+        CounterRecord counter = tags.getRecord<CounterRecord>(instruction.operands[0]);
+        long long accValue = counter.acc;
+        bool counted = updateCounter(counter.pre, accValue, counter.bits, currentBranchState, countUp);
+        traceCounter(instruction, counted, currentBranchState, countUp);
+        if (accValue > INT32_MAX || accValue < INT32_MIN) {
+            // The accumulator wraps like a PLC counter and the overflow bit latches
+            counter.bits |= accValue > INT32_MAX ? CounterOV : CounterUN;
+            accValue = static_cast<int32_t>(static_cast<uint32_t>(accValue));
+        }
+        counter.acc = accValue;
+        tags.setRecord(instruction.operands[0], counter);
+        if (traceEnabled) std::cout << "ACC: " << counter.acc << ", DN: " << boolToString(counter.bits & CounterDN) << std::endl;
         return currentBranchState;
     }
 
-    int preValue = std::get<int>(variableMap[pre]);
-    int accValue = std::get<int>(variableMap[acc]);
-    bool ctValue = getBoolValue(ct);
-
-    if (currentBranchState && !ctValue) {
-        accValue++;
-        setBoolValue(ct, true);
-        std::cout << "CTU[" << params << "] === ";
-    } else if (!currentBranchState) {
-        setBoolValue(ct, false);
-        std::cout << "CTU[" << params << "] --- ";
+    if (!hasOperands(instruction, 4)) {
+        std::cerr << instruction.opcode << " instruction has incomplete parameters." << std::endl;
+        return currentBranchState;
     }
 
-    if (accValue >= preValue) {
-        setBoolValue(dn, true);
-    } else {
-        setBoolValue(dn, false);
-    }
+    // Parameters are pre, acc, ct, dn
+    long long preValue = getIntegerValue(instruction, 0);
+    long long accValue = getIntegerValue(instruction, 1);
+    uint8_t countBit = countUp ? CounterCU : CounterCD;
+    uint8_t bits = getBoolValue(instruction, 2) ? countBit : 0;
+
+    bool counted = updateCounter(preValue, accValue, bits, currentBranchState, countUp);
+    traceCounter(instruction, counted, currentBranchState, countUp);
 
-    variableMap[acc] = accValue;
-    std::cout << "ACC: " << accValue << ", DN: " << boolToString(getBoolValue(dn)) << std::endl;
+    setBoolValue(instruction, 2, bits & countBit);
+    setBoolValue(instruction, 3, bits & CounterDN);
+    tags.set(instruction.operands[1], accValue);
+    if (traceEnabled) std::cout << "ACC: " << accValue << ", DN: " << boolToString(bits & CounterDN) << std::endl;
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleCtdInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string pre, acc, ct, dn;
-    std::getline(paramStream, pre, ',');
-    std::getline(paramStream, acc, ',');
-    std::getline(paramStream, ct, ',');
-    std::getline(paramStream, dn, ',');
-
-    if (pre.empty() || acc.empty() || ct.empty() || dn.empty()) {
-        std::cerr << "CTD instruction has incomplete parameters." << std::endl;
-        return currentBranchState;
+void LadderLogicParser::traceCounter(const Instruction& instruction, bool counted, bool enabled, bool countUp) {
+    if (!traceEnabled) {
+        return;
     }
-
-    int accValue = std::get<int>(variableMap[acc]);
-    bool ctValue = getBoolValue(ct);
-
-    if (!currentBranchState && ctValue) {
-        accValue--;
-        setBoolValue(ct, false);
-        std::cout << "CTD[" << params << "] === ";
-    } else if (currentBranchState) {
-        setBoolValue(ct, true);
-        std::cout << "CTD[" << params << "] --- ";
+    if (counted) {
+        std::cout << instruction.opcode << "[" << instruction.params << "] === ";
+    } else if (enabled != countUp) {
+        std::cout << instruction.opcode << "[" << instruction.params << "] --- ";
     }
+}
 
-    if (accValue <= 0) {
-        setBoolValue(dn, true);
-    } else {
-        setBoolValue(dn, false);
+bool LadderLogicParser::updateCounter(long long preValue, long long& accValue, uint8_t& bits, bool enabled, bool countUp) {
+    bool counted = false;
+    if (countUp) {
+        if (enabled && !(bits & CounterCU)) {
+            accValue++;
+            counted = true;
+        }
+        bits = enabled ? (bits | CounterCU) : (bits & ~CounterCU);
+        bits = accValue >= preValue ? (bits | CounterDN) : (bits & ~CounterDN);
+        return counted;
     }
 
-    variableMap[acc] = accValue;
-    std::cout << "ACC: " << accValue << ", DN: " << boolToString(getBoolValue(dn)) << std::endl;
-    return currentBranchState;
+    // CTD counts when the rung goes false
+    if (!enabled && (bits & CounterCD)) {
+        accValue--;
+        counted = true;
+    }
+    bits = enabled ? (bits | CounterCD) : (bits & ~CounterCD);
+    bits = accValue <= 0 ? (bits | CounterDN) : (bits & ~CounterDN);
+    return counted;
 }
 
-bool LadderLogicParser::handleOnrInstruction(const std::string& var1, bool& currentBranchState) {
-    bool previousState = getBoolValue(var1);
+bool LadderLogicParser::handleOnrInstruction(const Instruction& instruction, bool& currentBranchState) {
+    bool previousState = getBoolValue(instruction, 0);
     if (currentBranchState && !previousState) {
-        setBoolValue(var1, true);
+        setBoolValue(instruction, 0, true);
         currentBranchState = true;
-        std::cout << "ONR[" << var1 << "]" << (currentBranchState ? " === " : " --- ");
+        if (traceEnabled) std::cout << "ONR[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
         return true;
     }
-    setBoolValue(var1, currentBranchState);
+    setBoolValue(instruction, 0, currentBranchState);
     currentBranchState = false;
-    std::cout << "ONR[" << var1 << "]" << (currentBranchState ? " === " : " --- ");
+    if (traceEnabled) std::cout << "ONR[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
     return false;
 }
 
-bool LadderLogicParser::handleOnfInstruction(const std::string& var1, bool& currentBranchState) {
-    bool previousState = getBoolValue(var1);
+bool LadderLogicParser::handleOnfInstruction(const Instruction& instruction, bool& currentBranchState) {
+    bool previousState = getBoolValue(instruction, 0);
     if (!currentBranchState && previousState) {
-        setBoolValue(var1, false);
+        setBoolValue(instruction, 0, false);
         currentBranchState = true;
-        std::cout << "ONF[" << var1 << "]" << (currentBranchState ? " === " : " --- ");
+        if (traceEnabled) std::cout << "ONF[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
         return true;
     }
-    setBoolValue(var1, currentBranchState);
+    setBoolValue(instruction, 0, currentBranchState);
     currentBranchState = false;
-    std::cout << "ONF[" << var1 << "]" << (currentBranchState ? " === " : " --- ");
+    if (traceEnabled) std::cout << "ONF[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
     return false;
 }
 
-void LadderLogicParser::handleBranchStart(std::stack<bool>& branchStack, std::stack<bool>& currentBranchStateStack, bool& branchResult, bool& currentBranchState) {
-    branchStack.push(branchResult);
-    currentBranchStateStack.push(currentBranchState);
-    branchResult = false;
-    currentBranchState = true;
-    std::cout << "<<" << std::endl;
+bool LadderLogicParser::handleTonInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleTimer(instruction, currentBranchState, true);
 }
 
-void LadderLogicParser::handleNextBranch(bool& branchResult, bool& currentBranchState) {
-    branchResult = branchResult || currentBranchState;
-    currentBranchState = true;
-    std::cout << "^^" << std::endl;
+bool LadderLogicParser::handleTofInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleTimer(instruction, currentBranchState, false);
 }
 
-void LadderLogicParser::handleBranchEnd(std::stack<bool>& branchStack, std::stack<bool>& currentBranchStateStack, bool& branchResult, bool& currentBranchState) {
-    branchResult = branchResult || currentBranchState;
-    currentBranchState = currentBranchStateStack.top();
-    currentBranchStateStack.pop();
-    branchResult = branchResult && currentBranchState;
-    currentBranchState = branchStack.top();
-    branchStack.pop();
-    currentBranchState = currentBranchState && branchResult;
-    std::cout << ">>" << std::endl;
-}
+bool LadderLogicParser::handleTimer(const Instruction& instruction, bool& currentBranchState, bool onDelay) {
+    long long preValue;
+    long long accValue;
 
-bool LadderLogicParser::handleTonInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string dn, tt, pre, acc;
-    std::getline(paramStream, dn, ',');
-    std::getline(paramStream, tt, ',');
-    std::getline(paramStream, pre, ',');
-    std::getline(paramStream, acc, ',');
+    // TON(timer) and TOF(timer) load and store the whole TIMER record at once
+    if (instruction.operands.size() == 1 && instruction.operands[0].type == DataType::STRUCT) {
+        if (instruction.operands[0].structType != TagDatabase::TimerType) {
+            throw std::invalid_argument("Variable is not a TIMER: " + instruction.operandNames[0]);
+        }
+        TimerRecord timer = tags.getRecord<TimerRecord>(instruction.operands[0]);
+        preValue = timer.pre;
+        accValue = timer.acc;
+        updateTimer(preValue, accValue, timer.bits, currentBranchState, onDelay);
+        timer.acc = accValue;
+        tags.setRecord(instruction.operands[0], timer);
+    } else {
+        if (!hasOperands(instruction, 4)) {
+            std::cerr << instruction.opcode << " instruction has incomplete parameters." << std::endl;
+            return currentBranchState;
+        }
 
-    if (dn.empty() || tt.empty() || pre.empty() || acc.empty()) {
-        std::cerr << "TON instruction has incomplete parameters." << std::endl;
-        return currentBranchState;
+        // Parameters are dn, tt, pre, acc
+        preValue = getIntegerValue(instruction, 2);
+        accValue = getIntegerValue(instruction, 3);
+        uint8_t bits = 0;
+
+        updateTimer(preValue, accValue, bits, currentBranchState, onDelay);
+
+        setBoolValue(instruction, 1, bits & TimerTT);
+        setBoolValue(instruction, 0, bits & TimerDN);
+        tags.set(instruction.operands[3], accValue);
     }
 
-    int preValue = std::get<int>(variableMap[pre]);
-    int accValue = std::get<int>(variableMap[acc]);
+    if (traceEnabled) std::cout << instruction.opcode << "(" << accValue << "/" << preValue << ")" << (currentBranchState ? " === " : " --- ");
+    return currentBranchState;
+}
 
-    if (currentBranchState) {
-        variableMap[tt] = true;
+void LadderLogicParser::updateTimer(long long preValue, long long& accValue, uint8_t& bits, bool enabled, bool onDelay) {
+    // TON times while the rung is true, TOF while it is false. DN is the delayed output.
+    bool timing = onDelay ? enabled : !enabled;
+    bits = enabled ? TimerEN : 0;
+    if (timing) {
         accValue += scanTime;
         if (accValue >= preValue) {
             accValue = preValue;
-            variableMap[dn] = true;
-            variableMap[tt] = false;
+            bits |= onDelay ? TimerDN : 0;
         } else {
-            variableMap[dn] = false;
+            bits |= TimerTT | (onDelay ? 0 : TimerDN);
         }
     } else {
         accValue = 0;
-        variableMap[tt] = false;
-        variableMap[dn] = false;
+        bits |= onDelay ? 0 : TimerDN;
     }
+}
 
-    variableMap[acc] = accValue;
-    std::cout << "TON(" << accValue << "/" << preValue << ")" << (currentBranchState ? " === " : " --- ");
-    return currentBranchState;
+bool LadderLogicParser::handleAddInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleArithmetic(instruction, currentBranchState, '+');
 }
 
-bool LadderLogicParser::handleTofInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string dn, tt, pre, acc;
-    std::getline(paramStream, dn, ',');
-    std::getline(paramStream, tt, ',');
-    std::getline(paramStream, pre, ',');
-    std::getline(paramStream, acc, ',');
+bool LadderLogicParser::handleSubInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleArithmetic(instruction, currentBranchState, '-');
+}
 
-    if (dn.empty() || tt.empty() || pre.empty() || acc.empty()) {
-        std::cerr << "TOF instruction has incomplete parameters." << std::endl;
+bool LadderLogicParser::handleArithmetic(const Instruction& instruction, bool& currentBranchState, char operation) {
+    if (!hasOperands(instruction, 3)) {
+        std::cerr << instruction.opcode << " instruction has incomplete parameters." << std::endl;
         return currentBranchState;
     }
 
-    int preValue = std::get<int>(variableMap[pre]);
-    int accValue = std::get<int>(variableMap[acc]);
+    const std::string& var1 = instruction.operandNames[0];
+    const std::string& var2 = instruction.operandNames[1];
 
     if (!currentBranchState) {
-        variableMap[tt] = true;
-        accValue += scanTime;
-        if (accValue >= preValue) {
-            accValue = preValue;
-            variableMap[dn] = false;
-            variableMap[tt] = false;
-        } else {
-            variableMap[dn] = true;
-        }
+        if (traceEnabled) std::cout << instruction.opcode << "(" << var1 << " " << operation << " " << var2 << ")" << " --- ";
+        return currentBranchState;
+    }
+
+    // Both sources must have the same type, the result is converted to the destination's type
+    TagRef source1 = instruction.operands[0];
+    TagRef source2 = instruction.operands[1];
+    TagRef destination = instruction.operands[2];
+    if (source1.type != source2.type || source1.type == DataType::BOOL) {
+        std::cerr << instruction.opcode << " instruction type mismatch: " << var1 << ", " << var2 << std::endl;
+        return currentBranchState;
+    }
+
+    if (isIntegerType(source1.type)) {
+        long long val1 = tags.get<long long>(source1);
+        long long val2 = tags.get<long long>(source2);
+        tags.set(destination, operation == '+' ? val1 + val2 : val1 - val2);
+    } else if (source1.type == DataType::REAL) {
+        float val1 = tags.get<float>(source1);
+        float val2 = tags.get<float>(source2);
+        tags.set(destination, operation == '+' ? val1 + val2 : val1 - val2);
     } else {
-        accValue = 0;
-        variableMap[tt] = false;
-        variableMap[dn] = true;
+        double val1 = tags.get<double>(source1);
+        double val2 = tags.get<double>(source2);
+        tags.set(destination, operation == '+' ? val1 + val2 : val1 - val2);
     }
 
-    variableMap[acc] = accValue;
-    std::cout << "TOF(" << accValue << "/" << preValue << ")" << (currentBranchState ? " === " : " --- ");
+    if (traceEnabled) {
+        std::cout << instruction.opcode << "(" << var1 << " " << operation << " " << var2 << " = ";
+        tags.printValue(std::cout, destination);
+        std::cout << ")" << " === ";
+    }
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleAddInstruction(const std::string& params, bool& currentBranchState) {
-    std::istringstream paramStream(params);
-    std::string var1, var2, var3;
-    std::getline(paramStream, var1, ',');
-    std::getline(paramStream, var2, ',');
-    std::getline(paramStream, var3, ',');
+bool LadderLogicParser::handleLssInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 2)) {
+        std::cerr << "LSS instruction has incomplete parameters." << std::endl;
+        return currentBranchState;
+    }
+
+    bool result = compareOperands(instruction, false) < 0;
+    if (traceEnabled) std::cout << "LSS[" << instruction.params << "]" << (result ? " === " : " --- ");
+    return result;
+}
 
-    if (var1.empty() || var2.empty() || var3.empty()) {
-        std::cerr << "ADD instruction has incomplete parameters." << std::endl;
+bool LadderLogicParser::handleGtrInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 2)) {
+        std::cerr << "GTR instruction has incomplete parameters." << std::endl;
         return currentBranchState;
     }
 
+    bool result = compareOperands(instruction, false) > 0;
+    if (traceEnabled) std::cout << "GTR[" << instruction.params << "]" << (result ? " === " : " --- ");
+    return result;
+}
+
+bool LadderLogicParser::handleFadInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileArithmetic(instruction, currentBranchState, '+');
+}
+
+bool LadderLogicParser::handleFsbInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileArithmetic(instruction, currentBranchState, '-');
+}
+
+bool LadderLogicParser::handleFmuInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileArithmetic(instruction, currentBranchState, '*');
+}
+
+bool LadderLogicParser::handleFdvInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileArithmetic(instruction, currentBranchState, '/');
+}
+
+bool LadderLogicParser::handleFgrInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileCompare(instruction, currentBranchState, '>');
+}
+
+bool LadderLogicParser::handleFlsInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileCompare(instruction, currentBranchState, '<');
+}
+
+bool LadderLogicParser::handleFeqInstruction(const Instruction& instruction, bool& currentBranchState) {
+    return handleFileCompare(instruction, currentBranchState, '=');
+}
+
+size_t LadderLogicParser::bulkLength(const Instruction& instruction, size_t lengthOperand) {
+    // Without a length the whole destination is processed
+    const TagRef& destination = instruction.operands[lengthOperand - 1];
+    size_t length = destination.count;
+    if (instruction.operandNames.size() > lengthOperand) {
+        length = instruction.length ? instruction.length : getIntegerValue(instruction, lengthOperand);
+    }
+
+    // Single values are used for every element, arrays must be long enough
+    for (size_t i = 0; i < lengthOperand; ++i) {
+        const TagRef& operand = instruction.operands[i];
+        if ((operand.count > 1 || i == lengthOperand - 1) && operand.count < length) {
+            throw std::invalid_argument("length " + std::to_string(length) + " is longer than " + instruction.operandNames[i]);
+        }
+    }
+    return length;
+}
+
+bool LadderLogicParser::handleFileArithmetic(const Instruction& instruction, bool& currentBranchState, char operation) {
+    if (!hasOperands(instruction, 3)) {
+        std::cerr << instruction.opcode << " instruction has incomplete parameters." << std::endl;
+        return currentBranchState;
+    }
     if (!currentBranchState) {
-        std::cout << "ADD(" << var1 << " + " << var2 << ")" << " --- ";
+        if (traceEnabled) std::cout << instruction.opcode << "[" << instruction.params << "] --- ";
         return currentBranchState;
     }
 
-
-    if (variableMap.find(var1) != variableMap.end() && variableMap.find(var2) != variableMap.end()) {
-        if (std::holds_alternative<int>(variableMap[var1]) && std::holds_alternative<int>(variableMap[var2])) {
-            int result = std::get<int>(variableMap[var1]) + std::get<int>(variableMap[var2]);
-            variableMap[var3] = result;
-            std::cout << "ADD(" << var1 << " + " << var2 << " = " << result << ")" << " === ";
-        } else if (std::holds_alternative<double>(variableMap[var1]) && std::holds_alternative<double>(variableMap[var2])) {
-            double result = std::get<double>(variableMap[var1]) + std::get<double>(variableMap[var2]);
-            variableMap[var3] = result;
-            std::cout << "ADD(" << var1 << " + " << var2 << " = " << result << ")" << " === ";
-        } else {
-            std::cerr << "ADD instruction type mismatch: " << var1 << ", " << var2 << std::endl;
+    // Parameters are source A, source B, destination and an optional length, all of the same type
+    TagRef source1 = instruction.operands[0];
+    TagRef source2 = instruction.operands[1];
+    TagRef destination = instruction.operands[2];
+    if (source1.type != destination.type || source2.type != destination.type) {
+        throw std::invalid_argument("type mismatch: " + instruction.params);
+    }
+    size_t count = bulkLength(instruction, 3);
+
+    uint8_t* image = tags.data();
+    uint8_t* dest = image + destination.offset;
+    const uint8_t* a = image + source1.offset;
+    const uint8_t* b = image + source2.offset;
+    bool scalarA = source1.count == 1;
+    bool scalarB = source2.count == 1;
+    forNumericType(destination.type, [&](auto zero) {
+        using T = decltype(zero);
+        switch (operation) {
+            case '+': bulk::elementwise<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x + y; }); break;
+            case '-': bulk::elementwise<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x - y; }); break;
+            case '*': bulk::elementwise<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x * y; }); break;
+            case '/':
+                if (std::is_integral_v<T> && bulk::containsZero<T>(b, scalarB ? 1 : count)) {
+                    throw std::invalid_argument("division by zero in " + instruction.operandNames[1]);
+                }
+                bulk::elementwise<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x / y; });
+                break;
         }
-    } else {
-        std::cerr << "ADD instruction variables not found: " << var1 << ", " << var2 << std::endl;
+    });
+
+    if (traceEnabled) {
+        std::cout << instruction.opcode << "(" << instruction.operandNames[0] << " " << operation << " " << instruction.operandNames[1] << " = ";
+        tags.printValue(std::cout, destination);
+        std::cout << ")" << " === ";
     }
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleSubInstruction(const std::string& params, bool& currentBranchState) {
-
-        std::istringstream paramStream(params);
-        std::string var1, var2, var3;
-        std::getline(paramStream, var1, ',');
-        std::getline(paramStream, var2, ',');
-        std::getline(paramStream, var3, ',');
+bool LadderLogicParser::handleFileCompare(const Instruction& instruction, bool& currentBranchState, char comparison) {
+    if (!hasOperands(instruction, 3)) {
+        std::cerr << instruction.opcode << " instruction has incomplete parameters." << std::endl;
+        return currentBranchState;
+    }
+    if (!currentBranchState) {
+        if (traceEnabled) std::cout << instruction.opcode << "[" << instruction.params << "] --- ";
+        return currentBranchState;
+    }
 
-        if (var1.empty() || var2.empty() || var3.empty()) {
-            std::cerr << "SUB instruction has incomplete parameters." << std::endl;
-            return currentBranchState;
+    // Every element of the destination gets 1 where the comparison holds and 0 where not.
+    // The rung continues if it held for any element, e.g. any channel above its limit.
+    TagRef source1 = instruction.operands[0];
+    TagRef source2 = instruction.operands[1];
+    TagRef destination = instruction.operands[2];
+    if (source1.type != destination.type || source2.type != destination.type) {
+        throw std::invalid_argument("type mismatch: " + instruction.params);
+    }
+    size_t count = bulkLength(instruction, 3);
+
+    uint8_t* image = tags.data();
+    uint8_t* dest = image + destination.offset;
+    const uint8_t* a = image + source1.offset;
+    const uint8_t* b = image + source2.offset;
+    bool scalarA = source1.count == 1;
+    bool scalarB = source2.count == 1;
+    bool any = false;
+    forNumericType(destination.type, [&](auto zero) {
+        using T = decltype(zero);
+        switch (comparison) {
+            case '>': any = bulk::compare<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x > y; }); break;
+            case '<': any = bulk::compare<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x < y; }); break;
+            case '=': any = bulk::compare<T>(dest, a, scalarA, b, scalarB, count, [](auto x, auto y) { return x == y; }); break;
         }
+    });
 
-        if (!currentBranchState) {
-            std::cout << "SUB(" << var1 << " - " << var2 << ")" << " --- ";
-            return currentBranchState;
-        }
+    if (traceEnabled) std::cout << instruction.opcode << "[" << instruction.params << "]" << (any ? " === " : " --- ");
+    return any;
+}
 
-    if (variableMap.find(var1) != variableMap.end() && variableMap.find(var2) != variableMap.end()) {
-        if (std::holds_alternative<int>(variableMap[var1]) && std::holds_alternative<int>(variableMap[var2])) {
-            int result = std::get<int>(variableMap[var1]) - std::get<int>(variableMap[var2]);
-            variableMap[var3] = result;
-            std::cout << "SUB(" << var1 << " - " << var2 << " = " << result << ")" << " === ";
-        } else if (std::holds_alternative<double>(variableMap[var1]) && std::holds_alternative<double>(variableMap[var2])) {
-            double result = std::get<double>(variableMap[var1]) - std::get<double>(variableMap[var2]);
-            variableMap[var3] = result;
-            std::cout << "SUB(" << var1 << " - " << var2 << " = " << result << ")" << " === ";
-        } else {
-            std::cerr << "SUB instruction type mismatch: " << var1 << ", " << var2 << std::endl;
-        }
-    } else {
-        std::cerr << "SUB instruction variables not found: " << var1 << ", " << var2 << std::endl;
+bool LadderLogicParser::handleCopInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 2)) {
+        std::cerr << "COP instruction has incomplete parameters." << std::endl;
+        return currentBranchState;
+    }
+    if (!currentBranchState) {
+        if (traceEnabled) std::cout << "COP[" << instruction.params << "] --- ";
+        return currentBranchState;
     }
+
+    // Parameters are source, destination and an optional length
+    TagRef source = instruction.operands[0];
+    TagRef destination = instruction.operands[1];
+    if (source.type != destination.type || source.type == DataType::BOOL || source.type == DataType::STRUCT) {
+        throw std::invalid_argument("type mismatch: " + instruction.params);
+    }
+    size_t count = bulkLength(instruction, 2);
+    if (source.count < count) {
+        throw std::invalid_argument("length " + std::to_string(count) + " is longer than " + instruction.operandNames[0]);
+    }
+
+    // The ranges may overlap, e.g. shifting a history buffer by one element
+    std::memmove(tags.data() + destination.offset, tags.data() + source.offset, count * dataTypeSize(source.type));
+    if (traceEnabled) std::cout << "COP[" << instruction.params << "] === ";
     return currentBranchState;
 }
 
-bool LadderLogicParser::handleLssInstruction(const std::string& params, bool& currentBranchState) {
+bool LadderLogicParser::handleFllInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 2)) {
+        std::cerr << "FLL instruction has incomplete parameters." << std::endl;
+        return currentBranchState;
+    }
+    if (!currentBranchState) {
+        if (traceEnabled) std::cout << "FLL[" << instruction.params << "] --- ";
+        return currentBranchState;
+    }
 
-    std::istringstream paramStream(params);
-    std::string var1, var2;
-    std::getline(paramStream, var1, ',');
-    std::getline(paramStream, var2, ',');
+    // Parameters are the value, destination and an optional length. The value is converted to the destination's type.
+    TagRef source = instruction.operands[0];
+    TagRef destination = instruction.operands[1];
+    size_t count = bulkLength(instruction, 2);
+    forNumericType(destination.type, [&](auto zero) {
+        using T = decltype(zero);
+        bulk::fill<T>(tags.data() + destination.offset, tags.get<T>(source), count);
+    });
+    if (traceEnabled) std::cout << "FLL[" << instruction.params << "] === ";
+    return currentBranchState;
+}
 
-    if (var1.empty() || var2.empty()) {
-        std::cerr << "LSS instruction has incomplete parameters." << std::endl;
-        return currentBranchState;
+bool LadderLogicParser::handlePidInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (!hasOperands(instruction, 1) || instruction.operands[0].type != DataType::STRUCT || instruction.operands[0].structType != TagDatabase::PidType) {
+        throw std::invalid_argument("Variable is not a PID: " + instruction.params);
     }
 
-    if (variableMap.find(var1) != variableMap.end() && variableMap.find(var2) != variableMap.end()) {
-        bool result;
-        if (std::holds_alternative<int>(variableMap[var1]) && std::holds_alternative<int>(variableMap[var2])) {
-            int val1 = std::get<int>(variableMap[var1]);
-            int val2 = std::get<int>(variableMap[var2]);
-            result = val1 < val2;
-            std::cout << "LSS[" << params << "]" << (currentBranchState ? " === " : " --- ");
-        } else if (std::holds_alternative<double>(variableMap[var1]) && std::holds_alternative<double>(variableMap[var2])) {
-            double val1 = std::get<double>(variableMap[var1]);
-            double val2 = std::get<double>(variableMap[var2]);
-            result = val1 < val2;
-            std::cout << "LSS[" << params << "]" << (currentBranchState ? " === " : " --- ");
-        } else {
-            std::cerr << "LSS instruction type mismatch: " << var1 << ", " << var2 << std::endl;
-            return false;
-        }
-        return result;
+    // The loop itself runs at the end of the scan together with all other due loops, CV changes then
+    if (currentBranchState) {
+        pidEngine.schedule(instruction.loop);
     } else {
-        std::cerr << "LSS instruction variables not found: " << var1 << ", " << var2 << std::endl;
-        return false;
+        pidEngine.disable(instruction.loop);
     }
+
+    if (traceEnabled) {
+        // CV read through the operand resolved at load time, like the PID engine does, no lookup by name
+        std::cout << "PID[" << instruction.params << " CV=" << tags.getRecord<PidRecord>(instruction.operands[0]).cv << "]"
+                  << (currentBranchState ? " === " : " --- ");
+    }
+    return currentBranchState;
 }
 
-bool LadderLogicParser::handleGtrInstruction(const std::string& params, bool& currentBranchState) {
+bool LadderLogicParser::handleJsrInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (currentBranchState && instruction.target != SIZE_MAX) {
+        if (traceEnabled) std::cout << "JSR[" << instruction.params << "] ===" << std::endl;
+        callRoutine(instruction.target);
+        if (traceEnabled) std::cout << "| ===  RET[" << instruction.params << "] === ";
+    } else if (traceEnabled) {
+        std::cout << "JSR[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
+    }
+    return currentBranchState;
+}
 
-    std::istringstream paramStream(params);
-    std::string var1, var2;
-    std::getline(paramStream, var1, ',');
-    std::getline(paramStream, var2, ',');
+bool LadderLogicParser::handleRetInstruction(const Instruction& instruction, bool& currentBranchState) {
+    // Returns once the rung is finished, from the main program it ends the scan
+    if (currentBranchState && jumpTo != AbortScan) {
+        jumpTo = ReturnFromRoutine;
+    }
+    if (traceEnabled) std::cout << "RET" << (currentBranchState ? " === " : " --- ");
+    return currentBranchState;
+}
 
-    if (var1.empty() || var2.empty()) {
-        std::cerr << "GTR instruction has incomplete parameters." << std::endl;
-        return currentBranchState;
+bool LadderLogicParser::handleJmpInstruction(const Instruction& instruction, bool& currentBranchState) {
+    // Jumps once the rung is finished
+    if (currentBranchState && instruction.target != SIZE_MAX && jumpTo != AbortScan) {
+        jumpTo = instruction.target;
     }
+    if (traceEnabled) std::cout << "JMP[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
+    return currentBranchState;
+}
 
-    if (variableMap.find(var1) != variableMap.end() && variableMap.find(var2) != variableMap.end()) {
-        bool result;
-        if (std::holds_alternative<int>(variableMap[var1]) && std::holds_alternative<int>(variableMap[var2])) {
-            int val1 = std::get<int>(variableMap[var1]);
-            int val2 = std::get<int>(variableMap[var2]);
-            result = val1 > val2;
-            std::cout << "GTR[" << params << "]" << (currentBranchState ? " === " : " --- ");
-        } else if (std::holds_alternative<double>(variableMap[var1]) && std::holds_alternative<double>(variableMap[var2])) {
-            double val1 = std::get<double>(variableMap[var1]);
-            double val2 = std::get<double>(variableMap[var2]);
-            result = val1 > val2;
-            std::cout << "GTR[" << params << "]" << (currentBranchState ? " === " : " --- ");
-        } else {
-            std::cerr << "GTR instruction type mismatch: " << var1 << ", " << var2 << std::endl;
+bool LadderLogicParser::handleLblInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (traceEnabled) std::cout << "LBL[" << instruction.params << "]" << (currentBranchState ? " === " : " --- ");
+    return currentBranchState;
+}
+
+bool LadderLogicParser::handleMcrInstruction(const Instruction& instruction, bool& currentBranchState) {
+    // A true MCR rung starts a zone that runs normally, a false one switches the zone off up to the next MCR rung.
+    // The MCR that ends a zone has no conditions, so it is always true and switches the rungs after it back on.
+    mcrEnergized = currentBranchState;
+    if (traceEnabled) std::cout << "MCR" << (currentBranchState ? " === " : " --- ");
+    return currentBranchState;
+}
+
+bool LadderLogicParser::handleMsgInstruction(const Instruction& instruction, bool& currentBranchState) {
+    if (instruction.target == SIZE_MAX) {
+        throw std::invalid_argument("MSG is not set up: " + instruction.params);
+    }
+
+    // Picks up a completed request, then starts a new one when the rung becomes true. The request itself runs on
+    // a message worker, EN stays set while the rung is true or the request is still running.
+    size_t slot = instruction.target;
+    MessageRecord message = tags.getRecord<MessageRecord>(instruction.operands[0]);
+    if (messages.finish(slot, message) && journal) {
+        // Recorded before begin() hands the slot's buffer to a worker again
+        journal->messageCompleted(slot, message, messages.received(slot));
+    }
+    bool busy = messages.busy(slot);
+    if (currentBranchState && !(message.bits & MessageEN) && !busy) {
+        messages.begin(slot);
+        message = MessageRecord{0, 0, MessageEN};
+    } else if (!currentBranchState && !busy) {
+        message.bits &= ~MessageEN;
+    }
+    tags.setRecord(instruction.operands[0], message);
+
+    if (traceEnabled) {
+        std::cout << "MSG[" << instruction.params << (message.bits & MessageDN ? " DN" : "") << (message.bits & MessageER ? " ER" : "") << "]"
+                  << (currentBranchState ? " === " : " --- ");
+    }
+    return currentBranchState;
+}
+
+int LadderLogicParser::compareOperands(const Instruction& instruction, bool roundReals) {
+    TagRef ref1 = instruction.operands[0];
+    TagRef ref2 = instruction.operands[1];
+    if (ref1.type != ref2.type || ref1.type == DataType::BOOL) {
+        throw std::invalid_argument("type mismatch: " + instruction.operandNames[0] + ", " + instruction.operandNames[1]);
+    }
+
+    if (isIntegerType(ref1.type)) {
+        long long val1 = tags.get<long long>(ref1);
+        long long val2 = tags.get<long long>(ref2);
+        return (val1 > val2) - (val1 < val2);
+    }
+
+    // EQU and NEQ compare reals rounded to two decimals
+    double val1 = tags.get<double>(ref1);
+    double val2 = tags.get<double>(ref2);
+    if (roundReals) {
+        val1 = roundToTwoDecimals(val1);
+        val2 = roundToTwoDecimals(val2);
+    }
+    return (val1 > val2) - (val1 < val2);
+}
+
+bool LadderLogicParser::hasOperands(const Instruction& instruction, size_t count) {
+    if (instruction.operands.size() < count) {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!instruction.operands[i]) {
             return false;
         }
-        return result;
-    } else {
-        std::cerr << "GTR instruction variables not found: " << var1 << ", " << var2 << std::endl;
-        return false;
     }
+    return true;
 }
 
-bool LadderLogicParser::getBoolValue(const std::string& varName) {
-    auto it = variableMap.find(varName);
-    if (it != variableMap.end() && std::holds_alternative<bool>(it->second)) {
-        return std::get<bool>(it->second);
+bool LadderLogicParser::getBoolValue(const Instruction& instruction, size_t operand) {
+    if (operand < instruction.operands.size() && instruction.operands[operand] && instruction.operands[operand].type == DataType::BOOL) {
+        return tags.getBool(instruction.operands[operand]);
     }
-    throw std::invalid_argument("Variable not found or not a bool: " + varName);
+    throw std::invalid_argument("Variable not found or not a bool: " + (operand < instruction.operandNames.size() ? instruction.operandNames[operand] : instruction.params));
 }
 
-void LadderLogicParser::setBoolValue(const std::string& varName, bool value) {
-    variableMap[varName] = value;
+void LadderLogicParser::setBoolValue(const Instruction& instruction, size_t operand, bool value) {
+    if (operand < instruction.operands.size() && instruction.operands[operand] && instruction.operands[operand].type == DataType::BOOL) {
+        tags.setBool(instruction.operands[operand], value);
+        return;
+    }
+    throw std::invalid_argument("Variable not found or not a bool: " + (operand < instruction.operandNames.size() ? instruction.operandNames[operand] : instruction.params));
+}
+
+long long LadderLogicParser::getIntegerValue(const Instruction& instruction, size_t operand) {
+    if (operand < instruction.operands.size() && isIntegerType(instruction.operands[operand].type)) {
+        return tags.get<long long>(instruction.operands[operand]);
+    }
+    throw std::invalid_argument("Variable not found or not an integer: " + (operand < instruction.operandNames.size() ? instruction.operandNames[operand] : instruction.params));
 }
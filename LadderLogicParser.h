@@ -1,61 +1,282 @@
+#ifndef LADDER_LOGIC_PARSER_H
+#define LADDER_LOGIC_PARSER_H
+
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <string>
-#include <variant>
+#include <string_view>
 #include <vector>
-#include <stack>
 #include <chrono>
 #include <unordered_map>
 #include <functional>
+#include <cstdint>
+#include "TagDatabase.h"
+#include "PidEngine.h"
+#include "MessageExecutor.h"
+
+class AlarmEngine;
+class Debugger;
+class ScanJournal;
+class TagPublisher;
+namespace embedded {
+struct ProgramView;
+}
+
+// A single instruction of a rung, with its parameters resolved to tags when the logic is loaded
+struct Instruction {
+    std::string opcode;
+    std::string params; // parameter text as written, used by the trace
+    std::vector<std::string> operandNames;
+    std::vector<TagRef> operands;
+    const std::function<bool(const Instruction&, bool&)>* handler = nullptr;
+    const std::function<bool(const Instruction&, bool&)>* originalHandler = nullptr; // while the debugger hooks this instruction
+    bool readOnly = false;
+    uint32_t length = 0; // a parameter written as a number, the element count of the array instructions
+    size_t loop = 0; // PID: the loop in the PID engine
+    size_t target = SIZE_MAX; // JSR: the routine it calls, JMP: the rung it jumps to, MSG: its slot in the message executor
+    std::vector<size_t> invalidates; // shared prefixes that read a tag this instruction writes
+};
+
+// A node of the expression tree a rung's branches are compiled into.
+// Series nodes AND their children in order, parallel nodes OR their branches.
+struct RungNode {
+    enum Kind { Leaf, Series, Parallel };
+
+    Kind kind = Leaf;
+    bool readOnly = true; // nothing below this node writes a variable, so it can be skipped once its result is known
+    size_t instruction = 0; // Leaf: index into Rung::instructions
+    size_t firstChild = 0; // Series and Parallel: range in Rung::children
+    size_t childCount = 0;
+};
+
+// A numbered line of logic
+struct Rung {
+    std::string number;
+    std::vector<Instruction> instructions;
+    std::vector<RungNode> nodes;
+    std::vector<size_t> children;
+    size_t root = 0;
+    size_t sharedPrefix = SIZE_MAX; // index into the parser's shared prefixes, if this rung starts with one
+    size_t sharedPrefixLength = 0; // number of root children the shared prefix covers
+    bool mcr = false; // holds an MCR, which runs even inside a switched off zone so it can end the zone
+    std::string source; // the tokens as written, joined by spaces, a reload compares rungs by it
+    std::vector<std::string> prefixes; // text of each read-only run of root children from the start, longest last
+};
+
+// The main program or an SBR section: a range of rungs
+struct Routine {
+    std::string name;
+    size_t firstRung = 0;
+    size_t endRung = 0;
+};
+
+// A rung of logic split into tokens, before it is compiled
+struct RungSource {
+    std::string number;
+    std::vector<std::string> tokens;
+    std::string text; // the tokens joined by spaces
+    size_t routine = 0;
+};
+
+// A logic file split into routines and rungs. Splitting needs no tags, so it can be done off the scan thread.
+struct ProgramSource {
+    std::vector<Routine> routines; // the main program first
+    std::vector<RungSource> rungs;
+};
+
+// The rungs an online program change touched, each named routine/number
+struct ReloadSummary {
+    bool applied = false;
+    std::vector<std::string> added;
+    std::vector<std::string> changed;
+    std::vector<std::string> removed;
+    size_t unchanged = 0;
+    long long microseconds = 0; // how long the scan was held to apply it
+};
 
-using Variable = std::variant<int, bool, double>;
+// A read-only run of instructions that several rungs start with.
+// It is evaluated once and reused until one of its inputs is written or the next scan starts.
+struct SharedPrefix {
+    std::string text;
+    std::vector<TagRef> inputs;
+    size_t instructionCount = 0;
+    bool valid = false;
+    bool value = false;
+};
+
+// An instruction handler and what the compiler needs to know about it
+struct InstructionDefinition {
+    std::function<bool(const Instruction&, bool&)> execute;
+    unsigned writes; // bit n is set if the instruction writes its n-th parameter, 0 for read-only instructions
+    bool programControl = false; // changes which rungs run, its parameter names a routine or a label instead of a tag
+    unsigned literals = 0; // bit n is set if the n-th parameter is a keyword or a file name instead of a tag
+};
 
 class LadderLogicParser {
 public:
-    LadderLogicParser(const std::vector<std::string>& logic, std::map<std::string, Variable>& variableMap);
+    LadderLogicParser(const std::vector<std::string>& logic, TagDatabase& tags);
+    LadderLogicParser(const embedded::ProgramView& program, TagDatabase& tags); // a program compiled into the executable, see EmbeddedProgram.h
     void parseAndExecute();
     void executeLogic(); // New method to execute logic without re-initializing
+    void executeLogic(int elapsedMicroseconds); // Advance the timers by time the caller measured since the last scan
+    void setVirtualClock(int tickMicroseconds); // Advance the scan clock by a fixed tick instead of wall time
 
-    int scanTime = 0; // in milliseconds
+    int scanTime = 0; // in microseconds, the time the timers advance by each scan
+    int executionTime = 0; // in microseconds, measured wall time of the last scan
+    long long simulatedTime = 0; // in microseconds, total time advanced by the virtual clock
+    long long scanClock = 0; // in microseconds, the sum of every scan's scanTime, PID loops measure their interval with it
     bool isFirstScan; // flag for the first scan
+    bool traceEnabled = true; // print the ladder trace to the console
+
+    // The debugger gets called at scan boundaries, and after every instruction that writes one of the given tags
+    void setDebugger(Debugger* debugger);
+    void patchWriters(const std::vector<TagRef>& refs);
+    const std::vector<Rung>& compiledRungs() const { return rungs; }
+    const std::vector<Routine>& compiledRoutines() const { return routines; }
+    MessageExecutor& messageExecutor() { return messages; } // the slots of the MSG instructions, for replay
+    void setJournal(ScanJournal* journal); // records every scan's outside writes and scan time
+    void setAlarms(AlarmEngine* alarms); // evaluated at the end of every scan
+    void setPublisher(TagPublisher* publisher); // handed a snapshot of the tags at the end of a scan when it wants one
+
+    // Online program changes. The new logic is compared with the running program rung by rung, by routine and rung
+    // number, and only added or edited rungs are compiled; the others keep their compiled form. The change is applied
+    // between two scans, or not at all if an edited rung uses an undeclared tag, an unknown instruction or MSG.
+    static ProgramSource splitLogic(const std::vector<std::string>& logic);
+    void requestReload(const std::vector<std::string>& logic); // any thread, applied before the next scan
+    bool reload(const std::vector<std::string>& logic); // on the scan thread between scans
+    ReloadSummary lastReload;
+
+    size_t sharedPrefixCount() const; // number of common rung prefixes found when the logic was loaded
+    size_t sharedPrefixRungs() const; // number of rungs that start with one of them
+    long long sharedPrefixHits = 0; // times a rung reused a prefix result instead of evaluating it
+    long long skippedEvaluations = 0; // instruction evaluations removed by reusing prefix results
+    long long rungsEvaluated = 0; // over all scans, rungs skipped by JMP or not called by JSR are not counted
+    int watchdogMicroseconds = 100000; // a scan still running backward jumps after this long is ended
 
 
 private:
-    std::unordered_map<std::string, std::function<bool(const std::string&, bool&)>> instructionHandlers;
-    
+    std::unordered_map<std::string, InstructionDefinition> instructionHandlers;
+
     std::vector<std::string> logic;
-    std::map<std::string, Variable>& variableMap;
+    std::vector<Rung> rungs;
+    std::vector<SharedPrefix> sharedPrefixes;
+    std::map<std::string, size_t> prefixIndex; // by text
+    // Rungs starting with each read-only prefix, kept up to date by reloads
+    struct PrefixHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view text) const { return std::hash<std::string_view>()(text); }
+    };
+    std::unordered_map<std::string, size_t, PrefixHash, std::equal_to<>> prefixRungCount;
+    std::vector<Routine> routines; // the main program first
+    TagDatabase& tags;
+    PidEngine pidEngine;
+    MessageExecutor messages;
     bool lineState;
-    bool endFound;
+    bool virtualClock = false;
+    int virtualTick = 0;
+    Debugger* debugger = nullptr;
+    ScanJournal* journal = nullptr;
+    AlarmEngine* alarms = nullptr;
+    TagPublisher* publisher = nullptr;
+
+    // A reload waiting for the next scan, and compile errors while compiling one
+    std::mutex reloadMutex;
+    ProgramSource pendingReload;
+    std::atomic<bool> reloadPending{false};
+    bool reloading = false;
+    size_t reloadErrors = 0;
+
+    // Program control while a scan runs
+    static constexpr size_t ReturnFromRoutine = SIZE_MAX - 1;
+    static constexpr size_t AbortScan = SIZE_MAX - 2;
+    size_t jumpTo = SIZE_MAX; // set by JMP, RET or the watchdog, acted on when the rung is finished
+    bool mcrEnergized = true; // false inside an MCR zone whose MCR rung is false
+    size_t callDepth = 0;
+    std::function<bool(const Instruction&, bool&)> debugHandler;
 
     std::chrono::high_resolution_clock::time_point initialTime;
+    std::chrono::high_resolution_clock::time_point scanStarted;
 
     void initializeInstructionHandlers();
+    void compileLogic();
+    void compileProgram(const ProgramSource& source);
+    Rung compileRung(const RungSource& source);
+    bool applyReload(ProgramSource& source);
+    void printReload(const ReloadSummary& summary);
+    void runScan();
+    void resolveProgramStructure();
+    template <bool Breakpoints>
+    void runRoutine(size_t routine);
+    void callRoutine(size_t routine);
+    size_t compileSeries(Rung& rung, const std::vector<std::string>& tokens, size_t& position, size_t depth);
+    size_t compileParallel(Rung& rung, const std::vector<std::string>& tokens, size_t& position, size_t depth);
+    Instruction compileInstruction(const std::string& token);
+    void findSharedPrefixes();
+    void countPrefixes(const Rung& rung, int change);
+    void assignSharedPrefix(Rung& rung);
+    void linkInstruction(Instruction& instruction, size_t firstPrefix, size_t endPrefix);
+    void linkPrefix(size_t prefix);
+    std::string nodeText(const Rung& rung, const RungNode& node);
+    void collectInputs(const Rung& rung, const RungNode& node, std::vector<TagRef>& inputs, size_t& instructionCount);
+    void registerPidLoop(Instruction& instruction); // if it is a PID on a PID record
+    TagRef resolveTag(const std::string& tagName);
+    bool writesOperand(const Instruction& instruction, size_t operand);
     double roundToTwoDecimals(double value);
 
-    void handleTokens(const std::vector<std::string>& tokens);
-    void handleInstruction(const std::string& instruction, const std::string& params, bool& currentBranchState);
-    void handleBranchStart(std::stack<bool>& branchStack, std::stack<bool>& currentBranchStateStack, bool& branchResult, bool& currentBranchState);
-    void handleNextBranch(bool& branchResult, bool& currentBranchState);
-    void handleBranchEnd(std::stack<bool>& branchStack, std::stack<bool>& currentBranchStateStack, bool& branchResult, bool& currentBranchState);
-    bool getBoolValue(const std::string& varName);
-    void setBoolValue(const std::string& varName, bool value);
-
-    bool handleTonInstruction(const std::string& params, bool& currentBranchState);
-    bool handleTofInstruction(const std::string& params, bool& currentBranchState);
-    bool handleAddInstruction(const std::string& params, bool& currentBranchState);
-    bool handleSubInstruction(const std::string& params, bool& currentBranchState);
-    bool handleLssInstruction(const std::string& params, bool& currentBranchState);
-    bool handleGtrInstruction(const std::string& params, bool& currentBranchState);
-    bool handleAfiInstruction(const std::string& params, bool& currentBranchState);
-    bool handleEquInstruction(const std::string& params, bool& currentBranchState);
-    bool handleNeqInstruction(const std::string& params, bool& currentBranchState);
-    bool handleOnrInstruction(const std::string& params, bool& currentBranchState);
-    bool handleOnfInstruction(const std::string& params, bool& currentBranchState);
-    bool handleCtuInstruction(const std::string& params, bool& currentBranchState);
-    bool handleCtdInstruction(const std::string& params, bool& currentBranchState);
-    bool handleXicInstruction(const std::string& params, bool& currentBranchState);
-    bool handleXioInstruction(const std::string& params, bool& currentBranchState);
-    bool handleOteInstruction(const std::string& params, bool& currentBranchState);
-    bool handleOtlInstruction(const std::string& params, bool& currentBranchState);
+    bool evaluateRung(const Rung& rung);
+    bool evaluateNode(const Rung& rung, const RungNode& node, bool currentBranchState);
+    bool evaluateSeries(const Rung& rung, const RungNode& node, size_t first, size_t last, bool currentBranchState);
+    void handleInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool getBoolValue(const Instruction& instruction, size_t operand);
+    void setBoolValue(const Instruction& instruction, size_t operand, bool value);
+    long long getIntegerValue(const Instruction& instruction, size_t operand);
+    bool hasOperands(const Instruction& instruction, size_t count);
+    int compareOperands(const Instruction& instruction, bool roundReals);
+    bool handleArithmetic(const Instruction& instruction, bool& currentBranchState, char operation);
+    bool handleTimer(const Instruction& instruction, bool& currentBranchState, bool onDelay);
+    bool handleCounter(const Instruction& instruction, bool& currentBranchState, bool countUp);
+    size_t bulkLength(const Instruction& instruction, size_t lengthOperand);
+    bool handleFileArithmetic(const Instruction& instruction, bool& currentBranchState, char operation);
+    bool handleFileCompare(const Instruction& instruction, bool& currentBranchState, char comparison);
+    void updateTimer(long long preValue, long long& accValue, uint8_t& bits, bool enabled, bool onDelay);
+    bool updateCounter(long long preValue, long long& accValue, uint8_t& bits, bool enabled, bool countUp);
+    void traceCounter(const Instruction& instruction, bool counted, bool enabled, bool countUp);
+
+    bool handleTonInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleTofInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleAddInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleSubInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleLssInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleGtrInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleAfiInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleEquInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleNeqInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleOnrInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleOnfInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleCtuInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleCtdInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleXicInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleXioInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleOteInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleOtlInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFadInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFsbInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFmuInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFdvInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFgrInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFlsInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFeqInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleCopInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleFllInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handlePidInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleJsrInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleRetInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleJmpInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleLblInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleMcrInstruction(const Instruction& instruction, bool& currentBranchState);
+    bool handleMsgInstruction(const Instruction& instruction, bool& currentBranchState);
 
 };
+
+#endif // LADDER_LOGIC_PARSER_H
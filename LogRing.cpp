@@ -0,0 +1,54 @@
+#include "LogRing.h"
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+LogRing::LogRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+LogRing::int_type LogRing::overflow(int_type ch) {
+    if (ch != traits_type::eof()) {
+        char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize LogRing::xsputn(const char* s, std::streamsize count) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    if (static_cast<size_t>(count) > buffer.size() - (h - t)) {
+        droppedBytes.fetch_add(count, std::memory_order_relaxed);
+        return count;
+    }
+
+    size_t first = std::min(static_cast<size_t>(count), buffer.size() - (h & mask));
+    std::memcpy(buffer.data() + (h & mask), s, first);
+    std::memcpy(buffer.data(), s + first, count - first);
+    head.store(h + count, std::memory_order_release);
+    return count;
+}
+
+size_t LogRing::drain(int fd) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t written = 0;
+    while (t != h) {
+        size_t chunk = std::min(h - t, buffer.size() - (t & mask));
+        ssize_t result = ::write(fd, buffer.data() + (t & mask), chunk);
+        if (result <= 0) {
+            break;
+        }
+        t += result;
+        written += result;
+    }
+    // Whatever could not be written is given up rather than retried forever
+    tail.store(h, std::memory_order_release);
+    return written;
+}
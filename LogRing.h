@@ -0,0 +1,30 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <streambuf>
+#include <vector>
+
+// Hands bytes from the scan thread to a writer thread without locks, so the scan never blocks on a terminal or a
+// disk: the console output of a real-time run, and the records of the scan journal.
+// Single producer, single consumer; output that does not fit is dropped and counted instead of waiting.
+class LogRing : public std::streambuf {
+public:
+    explicit LogRing(size_t capacity); // rounded up to a power of two
+    size_t drain(int fd);
+    long long dropped() const { return droppedBytes.load(std::memory_order_relaxed); }
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize count) override;
+
+private:
+    std::vector<char> buffer;
+    size_t mask;
+    std::atomic<size_t> head{0}; // written by the scan thread
+    std::atomic<size_t> tail{0}; // written by the logger thread
+    std::atomic<long long> droppedBytes{0};
+};
+
+#endif // LOG_RING_H
@@ -0,0 +1,417 @@
+#include "MessageExecutor.h"
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+constexpr int WorkerCount = 2;
+constexpr int ReceiveTimeoutMilliseconds = 5000;
+
+bool parseAddress(const std::string& text, sockaddr_in& address) {
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(std::atoi(text.c_str() + colon + 1));
+    return inet_pton(AF_INET, text.substr(0, colon).c_str(), &address.sin_addr) == 1 && address.sin_port != 0;
+}
+
+}
+
+MessageExecutor::MessageExecutor(TagDatabase& tags) : tags(tags) {
+}
+
+MessageExecutor::~MessageExecutor() {
+    running.store(false);
+    queued.release(workers.size());
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& slot : slots) {
+        if (slot->socket >= 0) {
+            close(slot->socket);
+        }
+    }
+}
+
+bool MessageExecutor::parseOperation(const std::string& text, MessageOperation& operation) {
+    if (text == "READ") {
+        operation = MessageOperation::Read;
+    } else if (text == "WRITE") {
+        operation = MessageOperation::Write;
+    } else if (text == "SEND") {
+        operation = MessageOperation::Send;
+    } else if (text == "RECEIVE") {
+        operation = MessageOperation::Receive;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+size_t MessageExecutor::add(MessageOperation operation, const std::string& target, TagRef data) {
+    bool text = operation == MessageOperation::Read || operation == MessageOperation::Write;
+    if (!data || data.type == DataType::BOOL || (text && data.type == DataType::STRUCT)) {
+        std::cerr << "MSG " << target << ": " << (text ? "READ and WRITE need a numeric tag or array" : "SEND and RECEIVE cannot use a BOOL")
+                  << std::endl;
+        return SIZE_MAX;
+    }
+    sockaddr_in address;
+    if (!text && !parseAddress(target, address)) {
+        std::cerr << "MSG: not an address:port, " << target << std::endl;
+        return SIZE_MAX;
+    }
+
+    auto slot = std::make_unique<Slot>();
+    slot->operation = operation;
+    slot->target = target;
+    slot->data = data;
+    slot->buffer.resize(tags.sizeOf(data));
+    slots.push_back(std::move(slot));
+    return slots.size() - 1;
+}
+
+void MessageExecutor::start() {
+    if (slots.empty()) {
+        return;
+    }
+
+    // The sockets are opened up front, so datagrams that arrive before a RECEIVE is started wait in the kernel
+    for (auto& slot : slots) {
+        sockaddr_in address;
+        if ((slot->operation != MessageOperation::Send && slot->operation != MessageOperation::Receive) || !parseAddress(slot->target, address)) {
+            continue;
+        }
+        slot->socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (slot->socket < 0) {
+            slot->socketError = errno;
+            continue;
+        }
+        int result = slot->operation == MessageOperation::Receive ? bind(slot->socket, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+                                                                  : connect(slot->socket, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        if (result != 0) {
+            // Each request of the MSG fails with this in ERR, nothing is printed
+            slot->socketError = errno;
+            close(slot->socket);
+            slot->socket = -1;
+        }
+    }
+
+    queue.assign(slots.size() + 1, 0);
+    running.store(true);
+    for (int i = 0; i < WorkerCount; ++i) {
+        workers.emplace_back(&MessageExecutor::work, this);
+    }
+}
+
+bool MessageExecutor::busy(size_t slot) const {
+    return slots[slot]->state.load(std::memory_order_acquire) != Idle;
+}
+
+void MessageExecutor::begin(size_t index) {
+    Slot& slot = *slots[index];
+    if (slot.operation == MessageOperation::Write || slot.operation == MessageOperation::Send) {
+        std::memcpy(slot.buffer.data(), tags.data() + slot.data.offset, slot.buffer.size());
+    }
+    slot.state.store(Queued, std::memory_order_release);
+    if (replaying) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue[queueTail] = index;
+        queueTail = (queueTail + 1) % queue.size();
+    }
+    queued.release();
+}
+
+bool MessageExecutor::finish(size_t index, MessageRecord& record) {
+    Slot& slot = *slots[index];
+    if (slot.state.load(std::memory_order_acquire) != Complete) {
+        return false;
+    }
+
+    std::memcpy(tags.data() + slot.data.offset, slot.buffer.data(), receivedBytes(slot));
+    record.err = slot.error;
+    record.len = slot.length;
+    record.bits = (record.bits & MessageEN) | (slot.error == 0 ? MessageDN : MessageER);
+    slot.state.store(Idle, std::memory_order_relaxed);
+    return true;
+}
+
+std::span<const uint8_t> MessageExecutor::received(size_t index) const {
+    const Slot& slot = *slots[index];
+    return {slot.buffer.data(), receivedBytes(slot)};
+}
+
+size_t MessageExecutor::receivedBytes(const Slot& slot) const {
+    if (slot.error != 0 || (slot.operation != MessageOperation::Read && slot.operation != MessageOperation::Receive)) {
+        return 0;
+    }
+    return slot.operation == MessageOperation::Read ? slot.length * dataTypeSize(slot.data.type) : slot.length;
+}
+
+size_t MessageExecutor::bufferBytes() const {
+    size_t bytes = 0;
+    for (const auto& slot : slots) {
+        bytes += slot->buffer.size();
+    }
+    return bytes;
+}
+
+void MessageExecutor::replayOnly() {
+    running.store(false);
+    queued.release(workers.size());
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    for (auto& slot : slots) {
+        if (slot->socket >= 0) {
+            close(slot->socket);
+            slot->socket = -1;
+        }
+    }
+    replaying = true;
+}
+
+bool MessageExecutor::complete(size_t index, int error, size_t length, std::span<const uint8_t> data) {
+    if (index >= slots.size()) {
+        return false;
+    }
+    Slot& slot = *slots[index];
+    slot.error = error;
+    slot.length = length;
+    if (data.size() != receivedBytes(slot) || data.size() > slot.buffer.size()) {
+        return false;
+    }
+    std::memcpy(slot.buffer.data(), data.data(), data.size());
+    slot.state.store(Complete, std::memory_order_release);
+    return true;
+}
+
+void MessageExecutor::work() {
+    while (true) {
+        queued.acquire();
+        if (!running.load()) {
+            return;
+        }
+
+        size_t index;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            index = queue[queueHead];
+            queueHead = (queueHead + 1) % queue.size();
+        }
+
+        Slot& slot = *slots[index];
+        slot.error = 0;
+        slot.length = 0;
+        execute(slot);
+        slot.state.store(Complete, std::memory_order_release);
+    }
+}
+
+void MessageExecutor::execute(Slot& slot) {
+    switch (slot.operation) {
+        case MessageOperation::Read: readFile(slot); break;
+        case MessageOperation::Write: writeFile(slot); break;
+        case MessageOperation::Send:
+            if (slot.socket < 0) {
+                slot.error = slot.socketError ? slot.socketError : ENOTCONN;
+            } else if (send(slot.socket, slot.buffer.data(), slot.buffer.size(), 0) < 0) {
+                slot.error = errno;
+            } else {
+                slot.length = slot.buffer.size();
+            }
+            break;
+        case MessageOperation::Receive: receive(slot); break;
+    }
+}
+
+void MessageExecutor::readFile(Slot& slot) {
+    // errno is cleared first, so a failed open never reports what an earlier request left in it
+    errno = 0;
+    std::ifstream file(slot.target);
+    int openError = errno;
+    if (!file) {
+        slot.error = openError ? openError : ENOENT;
+        return;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t elementSize = dataTypeSize(slot.data.type);
+    const char* position = text.data();
+    const char* end = text.data() + text.size();
+    while (slot.length < slot.data.count) {
+        while (position < end && (*position == ',' || std::isspace(static_cast<unsigned char>(*position)))) {
+            ++position;
+        }
+        if (position == end) {
+            break;
+        }
+        forNumericType(slot.data.type, [&](auto zero) {
+            decltype(zero) value;
+            auto [next, error] = std::from_chars(position, end, value);
+            if (error != std::errc()) {
+                slot.error = EINVAL;
+                return;
+            }
+            std::memcpy(slot.buffer.data() + slot.length * elementSize, &value, elementSize);
+            position = next;
+        });
+        if (slot.error != 0) {
+            return;
+        }
+        ++slot.length;
+    }
+    if (slot.length == 0) {
+        slot.error = ENODATA;
+    }
+}
+
+void MessageExecutor::writeFile(Slot& slot) {
+    std::string line;
+    size_t elementSize = dataTypeSize(slot.data.type);
+    for (size_t i = 0; i < slot.data.count; ++i) {
+        forNumericType(slot.data.type, [&](auto zero) {
+            decltype(zero) value;
+            std::memcpy(&value, slot.buffer.data() + i * elementSize, elementSize);
+            // The shortest text that reads back as the same value
+            char text[32];
+            auto result = std::to_chars(text, text + sizeof(text), value);
+            line.append(i > 0 ? "," : "").append(text, result.ptr);
+        });
+    }
+    line += '\n';
+
+    errno = 0;
+    std::ofstream file(slot.target, std::ios::app);
+    if (!file || !file.write(line.data(), line.size()).flush()) {
+        int writeError = errno;
+        slot.error = writeError ? writeError : EIO;
+        return;
+    }
+    slot.length = slot.data.count;
+}
+
+void MessageExecutor::receive(Slot& slot) {
+    if (slot.socket < 0) {
+        slot.error = slot.socketError ? slot.socketError : ENOTCONN;
+        return;
+    }
+
+    // Wait in short steps, so shutting down never waits for the whole timeout
+    for (int waited = 0; waited < ReceiveTimeoutMilliseconds && running.load(); waited += 100) {
+        pollfd fd = {slot.socket, POLLIN, 0};
+        if (poll(&fd, 1, 100) > 0) {
+            ssize_t received = recv(slot.socket, slot.buffer.data(), slot.buffer.size(), MSG_TRUNC);
+            if (received < 0) {
+                slot.error = errno;
+            } else if (static_cast<size_t>(received) > slot.buffer.size()) {
+                slot.error = EMSGSIZE; // longer than the tag, nothing is copied
+                slot.length = received;
+            } else {
+                slot.length = received;
+            }
+            return;
+        }
+    }
+    slot.error = ETIMEDOUT;
+}
+
+bool MessageExecutor::selfTest(std::ostream& out) {
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / ("ladder_logic_msg_" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    std::string file = (directory / "values.txt").string();
+
+    // A free loopback port, the SEND and RECEIVE slots are the two ends of it
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    getsockname(probe, reinterpret_cast<sockaddr*>(&address), &length);
+    close(probe);
+    std::string peer = "127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+
+    TagDatabase tags;
+    tags.declare("values", DataType::DINT, "0", 0, 4);
+    tags.declare("readback", DataType::DINT, "0", 0, 4);
+    tags.declare("packet", DataType::LREAL, "0");
+    tags.declare("received", DataType::LREAL, "0");
+    tags.declare("missing", DataType::DINT, "0");
+    tags.declare("unbound", DataType::LREAL, "0");
+    tags.layout();
+
+    bool passed = true;
+    {
+        MessageExecutor messages(tags);
+        size_t write = messages.add(MessageOperation::Write, file, tags.find("values"));
+        size_t read = messages.add(MessageOperation::Read, file, tags.find("readback"));
+        size_t send = messages.add(MessageOperation::Send, peer, tags.find("packet"));
+        size_t receive = messages.add(MessageOperation::Receive, peer, tags.find("received"));
+        size_t missing = messages.add(MessageOperation::Read, (directory / "missing.txt").string(), tags.find("missing"));
+        // The port is bound by the first RECEIVE already
+        size_t unbound = messages.add(MessageOperation::Receive, peer, tags.find("unbound"));
+        messages.start();
+
+        auto wait = [&messages](size_t slot) {
+            MessageRecord record{};
+            for (int waited = 0; waited < ReceiveTimeoutMilliseconds + 1000 && !messages.finish(slot, record); ++waited) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return record;
+        };
+        auto check = [&out, &passed](const char* name, bool ok, const MessageRecord& record) {
+            out << "MSG self-test " << name << ": " << (ok ? "passed" : "FAILED") << " (ERR " << record.err << ", LEN " << record.len << ")"
+                << std::endl;
+            passed = passed && ok;
+        };
+
+        int32_t values[] = {1, -2, 3, 40000};
+        std::memcpy(tags.data() + tags.find("values").offset, values, sizeof(values));
+        messages.begin(write);
+        MessageRecord record = wait(write);
+        check("WRITE", (record.bits & MessageDN) && record.len == 4, record);
+        messages.begin(read);
+        record = wait(read);
+        check("READ", (record.bits & MessageDN) && record.len == 4 &&
+                      std::memcmp(tags.data() + tags.find("readback").offset, values, sizeof(values)) == 0, record);
+
+        tags.set(tags.find("packet"), 2.5);
+        messages.begin(receive);
+        messages.begin(send);
+        record = wait(send);
+        check("SEND", (record.bits & MessageDN) && record.len == sizeof(double), record);
+        record = wait(receive);
+        check("RECEIVE", (record.bits & MessageDN) && tags.get<double>(tags.find("received")) == 2.5, record);
+
+        messages.begin(missing);
+        record = wait(missing);
+        check("READ of a missing file", (record.bits & MessageER) && record.err == ENOENT, record);
+        messages.begin(unbound);
+        record = wait(unbound);
+        check("RECEIVE on a port in use", (record.bits & MessageER) && record.err == EADDRINUSE, record);
+    }
+
+    std::filesystem::remove_all(directory);
+    return passed;
+}
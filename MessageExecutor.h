@@ -0,0 +1,92 @@
+#ifndef MESSAGE_EXECUTOR_H
+#define MESSAGE_EXECUTOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <semaphore>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TagDatabase.h"
+
+enum class MessageOperation { Read, Write, Send, Receive };
+
+// Carries out the requests of the MSG instructions on worker threads, so file and network I/O never blocks the scan.
+//
+// Each MSG instruction owns one slot, set up when the logic is compiled. On the scan thread begin() copies the data
+// tag into the slot's buffer and queues the slot; a worker does the I/O on that buffer only and then marks the slot
+// complete. The MSG instruction polls its slot with finish() every time it runs, which copies received data into
+// the tag and fills in the MESSAGE record, so tags are only ever touched by the scan thread. The scan thread never
+// allocates or waits for a lock held during I/O.
+//
+//   READ    values from a text file (separated by commas, spaces or lines) into a numeric tag or array
+//   WRITE   a numeric tag or array as one comma-separated line appended to a text file
+//   SEND    the raw bytes of any tag as one UDP datagram to host:port
+//   RECEIVE the next UDP datagram arriving on host:port into any tag, waiting up to five seconds for one
+class MessageExecutor {
+public:
+    explicit MessageExecutor(TagDatabase& tags);
+    ~MessageExecutor();
+
+    static bool parseOperation(const std::string& text, MessageOperation& operation);
+    // Returns the slot, or SIZE_MAX with an error printed if the data tag does not suit the operation
+    size_t add(MessageOperation operation, const std::string& target, TagRef data);
+    void start(); // opens the sockets and starts the workers, if there are any slots
+
+    bool busy(size_t slot) const;
+    void begin(size_t slot);
+    bool finish(size_t slot, MessageRecord& record); // true once, when the request has completed
+    std::span<const uint8_t> received(size_t slot) const; // what that finish() copied into the data tag
+
+    // Replaying a scan journal: the workers are stopped and the sockets closed, and a request only completes when
+    // the journal hands in what it read or received. False if that does not fit the slot.
+    size_t size() const { return slots.size(); }
+    size_t bufferBytes() const; // of all slots, the data one completion of each carries at most
+    void replayOnly();
+    bool complete(size_t slot, int error, size_t length, std::span<const uint8_t> data);
+
+    // Runs every operation against a temporary file and a loopback UDP port, and the error paths of a missing file
+    // and a port already in use. Prints one line per check, true if all passed.
+    static bool selfTest(std::ostream& out);
+
+private:
+    enum State { Idle, Queued, Complete };
+
+    struct Slot {
+        MessageOperation operation;
+        std::string target;
+        TagRef data;
+        std::vector<uint8_t> buffer; // owned by the worker while queued
+        int socket = -1;
+        int socketError = 0; // why the socket could not be opened, reported by every request
+        int error = 0;
+        size_t length = 0;
+        std::atomic<int> state{Idle};
+    };
+
+    TagDatabase& tags;
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<std::thread> workers;
+    std::atomic<bool> running{false};
+    bool replaying = false;
+
+    // Queued slots, at most one entry per slot so the ring never overflows
+    std::mutex mutex;
+    std::vector<size_t> queue;
+    size_t queueHead = 0;
+    size_t queueTail = 0;
+    std::counting_semaphore<> queued{0};
+
+    size_t receivedBytes(const Slot& slot) const;
+    void work();
+    void execute(Slot& slot);
+    void readFile(Slot& slot);
+    void writeFile(Slot& slot);
+    void receive(Slot& slot);
+};
+
+#endif // MESSAGE_EXECUTOR_H
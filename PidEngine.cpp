@@ -0,0 +1,185 @@
+#include "PidEngine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include "BulkKernels.h"
+
+namespace {
+
+using Vector = bulk::Simd<float>::Vector;
+constexpr size_t Lanes = bulk::Simd<float>::Lanes;
+
+Vector load(const std::vector<float>& values, size_t i) {
+    Vector v;
+    std::memcpy(&v, values.data() + i, sizeof(v));
+    return v;
+}
+
+void store(std::vector<float>& values, size_t i, Vector v) {
+    std::memcpy(values.data() + i, &v, sizeof(v));
+}
+
+}
+
+PidEngine::PidEngine(TagDatabase& tags) : tags(tags) {
+}
+
+size_t PidEngine::registerLoop(TagRef record) {
+    for (size_t loop = 0; loop < records.size(); ++loop) {
+        if (records[loop].offset == record.offset) {
+            return loop;
+        }
+    }
+
+    // Like a PLC's PID, an output range that was never set is 0 to 100 %
+    PidRecord pid = tags.getRecord<PidRecord>(record);
+    if (pid.cvMin == 0 && pid.cvMax == 0) {
+        pid.cvMax = 100;
+        tags.setRecord(record, pid);
+    }
+
+    records.push_back(record);
+    integral.push_back(0);
+    previousPv.push_back(0);
+    derivative.push_back(0);
+    lastRun.push_back(-1);
+    scheduled.push_back(0);
+    return records.size() - 1;
+}
+
+void PidEngine::reserve() {
+    size_t padded = (records.size() + Lanes - 1) / Lanes * Lanes;
+    due.reserve(records.size());
+    for (auto* values : {&sp, &pv, &cv, &kp, &ki, &kd, &tf, &cvMin, &cvMax, &dt, &stagedIntegral, &stagedPreviousPv, &stagedDerivative}) {
+        values->assign(padded, 0);
+    }
+}
+
+void PidEngine::schedule(size_t loop) {
+    if (!scheduled[loop]) {
+        scheduled[loop] = 1;
+        due.push_back(loop);
+    }
+}
+
+void PidEngine::disable(size_t loop) {
+    lastRun[loop] = -1;
+    TagRef enable = records[loop];
+    enable.type = DataType::BOOL;
+    enable.offset = (records[loop].offset + offsetof(PidRecord, bits)) * 8;
+    tags.setBool(enable, false);
+}
+
+void PidEngine::update(long long now) {
+    size_t count = due.size();
+    if (count == 0) {
+        return;
+    }
+
+    // Gather the due loops into the staging arrays
+    for (size_t j = 0; j < count; ++j) {
+        size_t loop = due[j];
+        PidRecord pid = tags.getRecord<PidRecord>(records[loop]);
+        sp[j] = pid.sp;
+        pv[j] = pid.pv;
+        kp[j] = pid.kp;
+        ki[j] = pid.ki;
+        kd[j] = pid.kd;
+        tf[j] = pid.tf;
+        cvMin[j] = pid.cvMin;
+        cvMax[j] = pid.cvMax;
+
+        if (lastRun[loop] < 0) {
+            // Restart bumplessly: carry on from the current output, no derivative from the old measurement
+            integral[loop] = pid.cv - pid.kp * (pid.sp - pid.pv);
+            previousPv[loop] = pid.pv;
+            derivative[loop] = 0;
+            lastRun[loop] = now;
+        }
+        dt[j] = std::max(now - lastRun[loop], 1LL) / 1e6f;
+        lastRun[loop] = now;
+        stagedIntegral[j] = integral[loop];
+        stagedPreviousPv[j] = previousPv[loop];
+        stagedDerivative[j] = derivative[loop];
+    }
+    // Lanes past the last loop are computed too, keep them harmless
+    for (size_t j = count; j % Lanes != 0; ++j) {
+        dt[j] = 1;
+    }
+
+    compute(count);
+
+    // Scatter the results back
+    for (size_t j = 0; j < count; ++j) {
+        size_t loop = due[j];
+        PidRecord pid = tags.getRecord<PidRecord>(records[loop]);
+        pid.cv = cv[j];
+        pid.bits = PidEN | (cv[j] >= cvMax[j] || cv[j] <= cvMin[j] ? PidSAT : 0);
+        tags.setRecord(records[loop], pid);
+        integral[loop] = stagedIntegral[j];
+        previousPv[loop] = stagedPreviousPv[j];
+        derivative[loop] = stagedDerivative[j];
+        scheduled[loop] = 0;
+    }
+    loopUpdates += count;
+    due.clear();
+}
+
+void PidEngine::compute(size_t count) {
+    for (size_t i = 0; i < count; i += Lanes) {
+        Vector setpoint = load(sp, i);
+        Vector measurement = load(pv, i);
+        Vector interval = load(dt, i);
+        Vector low = load(cvMin, i);
+        Vector high = load(cvMax, i);
+        Vector integralTerm = load(stagedIntegral, i);
+        Vector derivativeTerm = load(stagedDerivative, i);
+
+        Vector error = setpoint - measurement;
+        Vector proportional = load(kp, i) * error;
+
+        // Derivative on the measurement, through a first order filter with time constant TF
+        Vector rawDerivative = load(kd, i) * (load(stagedPreviousPv, i) - measurement) / interval;
+        derivativeTerm += interval / (load(tf, i) + interval) * (rawDerivative - derivativeTerm);
+
+        // Only integrate if that does not push the output further past a limit
+        Vector candidate = integralTerm + load(ki, i) * error * interval;
+        Vector output = proportional + candidate + derivativeTerm;
+        auto windup = ((output > high) & (error > 0.0f)) | ((output < low) & (error < 0.0f));
+        integralTerm = windup ? integralTerm : candidate;
+
+        output = proportional + integralTerm + derivativeTerm;
+        output = output > high ? high : output;
+        output = output < low ? low : output;
+
+        store(cv, i, output);
+        store(stagedIntegral, i, integralTerm);
+        store(stagedDerivative, i, derivativeTerm);
+        store(stagedPreviousPv, i, measurement);
+    }
+}
+
+double PidEngine::benchmark(size_t loopCount, int updates) {
+    TagDatabase tags;
+    for (size_t i = 0; i < loopCount; ++i) {
+        tags.declare("loop" + std::to_string(i), DataType::STRUCT, "SP=50,PV=20,KP=2,KI=0.5,KD=0.1,TF=0.05", TagDatabase::PidType);
+    }
+    tags.layout();
+
+    PidEngine engine(tags);
+    for (size_t i = 0; i < loopCount; ++i) {
+        engine.registerLoop(tags.find("loop" + std::to_string(i)));
+    }
+    engine.reserve();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int update = 1; update <= updates; ++update) {
+        for (size_t loop = 0; loop < loopCount; ++loop) {
+            engine.schedule(loop);
+        }
+        engine.update(update * 10000LL);
+    }
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    return engine.loopUpdates / elapsed;
+}
@@ -0,0 +1,49 @@
+#ifndef PID_ENGINE_H
+#define PID_ENGINE_H
+
+#include <cstdint>
+#include <vector>
+#include "TagDatabase.h"
+
+// Runs the PID loops of a program. The PID instruction only marks its loop as due; at the end of the scan
+// update() gathers every due loop into structure-of-arrays staging, computes them all in one vectorised pass and
+// writes the outputs back to their PID tags.
+//
+// Each loop is a parallel form PID with derivative on the measurement (no kick on setpoint changes), a first order
+// derivative filter, output clamping and conditional integration as anti-windup: the integral does not grow while
+// the output is held at a limit in the same direction. The interval is the real time since the loop last ran.
+class PidEngine {
+public:
+    explicit PidEngine(TagDatabase& tags);
+
+    size_t registerLoop(TagRef record); // when the logic is compiled, the same tag always gets the same loop
+    void reserve(); // sizes the staging arrays once all loops are known, so update() does not allocate
+    void schedule(size_t loop); // the loop's rung is true this scan
+    void disable(size_t loop); // the loop's rung is false, it restarts bumplessly when enabled again
+    void update(long long now); // in microseconds, runs every loop scheduled since the last update
+
+    size_t loopCount() const { return records.size(); }
+    long long loopUpdates = 0;
+
+    // Loops per microsecond for a table of loopCount loops, all due every update
+    static double benchmark(size_t loopCount, int updates);
+
+private:
+    TagDatabase& tags;
+    std::vector<TagRef> records;
+
+    // Per loop state
+    std::vector<float> integral;
+    std::vector<float> previousPv;
+    std::vector<float> derivative;
+    std::vector<long long> lastRun; // -1 if the loop has to restart
+    std::vector<uint8_t> scheduled;
+    std::vector<uint32_t> due;
+
+    // Staging for the due loops, padded to whole vectors
+    std::vector<float> sp, pv, cv, kp, ki, kd, tf, cvMin, cvMax, dt, stagedIntegral, stagedPreviousPv, stagedDerivative;
+
+    void compute(size_t count);
+};
+
+#endif // PID_ENGINE_H
@@ -0,0 +1,287 @@
+#include "RealtimeRuntime.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t PrefaultStackBytes = 512 * 1024;
+constexpr size_t PageSize = 4096;
+
+std::atomic<bool> stopRequested{false};
+
+// The ring the calling thread's console output goes to, if any
+thread_local LogRing* threadRing = nullptr;
+
+void requestStop(int) {
+    stopRequested.store(true, std::memory_order_relaxed);
+}
+
+long long microsecondsBetween(const timespec& from, const timespec& to) {
+    return (to.tv_sec - from.tv_sec) * 1000000LL + (to.tv_nsec - from.tv_nsec) / 1000;
+}
+
+void addMicroseconds(timespec& time, long long microseconds) {
+    time.tv_nsec += (microseconds % 1000000) * 1000;
+    time.tv_sec += microseconds / 1000000 + time.tv_nsec / 1000000000;
+    time.tv_nsec %= 1000000000;
+}
+
+bool before(const timespec& a, const timespec& b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Touch every page the scan could grow its stack into, so those faults happen now and not during a scan
+void prefaultStack() {
+    unsigned char stack[PrefaultStackBytes];
+    volatile unsigned char* page = stack;
+    for (size_t i = 0; i < PrefaultStackBytes; i += PageSize) {
+        page[i] = 0;
+    }
+}
+
+}
+
+void LatencyStats::add(long long value) {
+    if (samples == 0 || value < minimum) {
+        minimum = value;
+    }
+    if (samples == 0 || value > maximum) {
+        maximum = value;
+    }
+    ++samples;
+    total += value;
+
+    int bucket = 0;
+    while (bucket < Buckets - 1 && value >= (1LL << bucket)) {
+        ++bucket;
+    }
+    ++histogram[bucket];
+}
+
+void LatencyStats::print(std::ostream& out, const char* title) const {
+    out << title << " (us): min " << minimum << ", avg " << (samples ? total / samples : 0) << ", max " << maximum << std::endl;
+    for (int bucket = 0; bucket < Buckets; ++bucket) {
+        if (histogram[bucket] == 0) {
+            continue;
+        }
+        if (bucket == Buckets - 1) {
+            out << "  >= " << (1LL << (bucket - 1)) << ": " << histogram[bucket] << std::endl;
+        } else {
+            out << "  < " << (1LL << bucket) << ": " << histogram[bucket] << std::endl;
+        }
+    }
+}
+
+void ConsoleRouter::routeToRing(LogRing* ring) {
+    threadRing = ring;
+}
+
+ConsoleRouter::int_type ConsoleRouter::overflow(int_type ch) {
+    if (ch == traits_type::eof()) {
+        return traits_type::not_eof(ch);
+    }
+    char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+}
+
+std::streamsize ConsoleRouter::xsputn(const char* s, std::streamsize count) {
+    return threadRing ? threadRing->sputn(s, count) : console->sputn(s, count);
+}
+
+int ConsoleRouter::sync() {
+    return threadRing ? 0 : console->pubsync();
+}
+
+RealtimeRuntime::RealtimeRuntime(LadderLogicParser& parser, TagDatabase& tags, const RealtimeOptions& options) :
+    parser(parser),
+    tags(tags),
+    options(options),
+    log(1 << 20) {
+}
+
+bool RealtimeRuntime::run() {
+    return periodicLoop(true);
+}
+
+bool RealtimeRuntime::selfCheck() {
+    return periodicLoop(false);
+}
+
+bool RealtimeRuntime::periodicLoop(bool executeLogic) {
+    startLogger();
+    configureThread();
+    prefault(executeLogic);
+
+    stopRequested.store(false);
+    auto previousInterrupt = std::signal(SIGINT, requestStop);
+    auto previousTerminate = std::signal(SIGTERM, requestStop);
+
+    long long period = options.periodMicroseconds;
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    timespec previousWakeup = next;
+
+    for (scans = 0; (options.scanLimit == 0 || scans < options.scanLimit) && !stopRequested.load(std::memory_order_relaxed); ++scans) {
+        addMicroseconds(next, period);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR) {
+            if (stopRequested.load(std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        timespec wakeup;
+        clock_gettime(CLOCK_MONOTONIC, &wakeup);
+        wakeupLatency.add(microsecondsBetween(next, wakeup));
+
+        if (executeLogic) {
+            // Timers advance by the real time between scans, not by how long the last scan took
+            parser.executeLogic(microsecondsBetween(previousWakeup, wakeup));
+        }
+        previousWakeup = wakeup;
+
+        timespec done;
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        scanDuration.add(microsecondsBetween(wakeup, done));
+
+        // Missed periods are skipped rather than run back to back
+        timespec deadline = next;
+        addMicroseconds(deadline, period);
+        if (!before(done, deadline)) {
+            ++overruns;
+            while (!before(done, deadline)) {
+                next = deadline;
+                addMicroseconds(deadline, period);
+            }
+        }
+    }
+
+    std::signal(SIGINT, previousInterrupt);
+    std::signal(SIGTERM, previousTerminate);
+    stopLogger();
+
+    printReport(std::cout, executeLogic);
+    bool passed = options.maxLatency == 0 || wakeupLatency.maximum <= options.maxLatency;
+    if (!passed) {
+        std::cerr << "Worst wakeup latency " << wakeupLatency.maximum << " us is above the limit of " << options.maxLatency << " us" << std::endl;
+    }
+    return passed;
+}
+
+void RealtimeRuntime::configureThread() {
+    pthread_t self = pthread_self();
+
+    if (options.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(options.cpu, &cpus);
+        int error = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+        if (error) {
+            std::cerr << "Could not pin the scan thread to CPU " << options.cpu << ": " << std::strerror(error) << std::endl;
+        } else {
+            pinned = true;
+        }
+
+        // Keep the logger off the scan core, if there is anywhere else for it to go
+        cpu_set_t others;
+        CPU_ZERO(&others);
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu < static_cast<int>(std::thread::hardware_concurrency()); ++cpu) {
+            if (cpu != options.cpu) {
+                CPU_SET(cpu, &others);
+            }
+        }
+        if (pinned && CPU_COUNT(&others) > 0) {
+            pthread_setaffinity_np(logger.native_handle(), sizeof(others), &others);
+        }
+    }
+
+    if (options.priority > 0) {
+        sched_param parameters{};
+        parameters.sched_priority = options.priority;
+        int error = pthread_setschedparam(self, SCHED_FIFO, &parameters);
+        if (error) {
+            std::cerr << "Could not set SCHED_FIFO priority " << options.priority << ": " << std::strerror(error) << std::endl;
+        } else {
+            fifo = true;
+        }
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        std::cerr << "Could not lock memory: " << std::strerror(errno) << std::endl;
+    } else {
+        locked = true;
+    }
+
+    // Freed memory stays in the process instead of going back to the kernel and faulting in again later
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+}
+
+void RealtimeRuntime::prefault(bool executeLogic) {
+    prefaultStack();
+
+    volatile uint8_t* image = tags.data();
+    for (size_t i = 0; i < tags.imageSize(); i += PageSize) {
+        image[i] = image[i];
+    }
+
+    // The first scan may still allocate (stream buffers and so on), so it runs here instead of in the first period
+    if (!executeLogic) {
+        return;
+    }
+    bool trace = parser.traceEnabled;
+    parser.traceEnabled = false;
+    parser.executeLogic(0);
+    parser.traceEnabled = trace;
+}
+
+void RealtimeRuntime::startLogger() {
+    loggerRunning.store(true);
+    logger = std::thread([this]() {
+        while (loggerRunning.load(std::memory_order_relaxed)) {
+            log.drain(STDOUT_FILENO);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        log.drain(STDOUT_FILENO);
+    });
+
+    std::cout.flush();
+    std::cerr.flush();
+    consoleOut = std::make_unique<ConsoleRouter>(std::cout.rdbuf());
+    consoleErr = std::make_unique<ConsoleRouter>(std::cerr.rdbuf());
+    std::cout.rdbuf(consoleOut.get());
+    std::cerr.rdbuf(consoleErr.get());
+    // Only this thread, which runs the scans, writes into the ring
+    ConsoleRouter::routeToRing(&log);
+}
+
+void RealtimeRuntime::stopLogger() {
+    ConsoleRouter::routeToRing(nullptr);
+    std::cout.rdbuf(consoleOut->consoleBuffer());
+    std::cerr.rdbuf(consoleErr->consoleBuffer());
+    loggerRunning.store(false);
+    logger.join();
+}
+
+void RealtimeRuntime::printReport(std::ostream& out, bool executeLogic) const {
+    out << "-------" << (executeLogic ? "Real-time run:" : "Real-time self-check:") << "-------" << std::endl;
+    out << "CPU: " << (pinned ? std::to_string(options.cpu) : "not pinned")
+        << ", scheduler: " << (fifo ? "SCHED_FIFO " + std::to_string(options.priority) : "normal")
+        << ", memory: " << (locked ? "locked" : "not locked") << std::endl;
+    out << (executeLogic ? "Scans: " : "Cycles: ") << scans << ", period " << options.periodMicroseconds << " us, overruns: " << overruns << std::endl;
+    wakeupLatency.print(out, "Wakeup latency");
+    if (executeLogic) {
+        scanDuration.print(out, "Scan duration");
+    }
+    if (log.dropped() > 0) {
+        out << "Console output dropped: " << log.dropped() << " bytes" << std::endl;
+    }
+    out << "-------" << "-------" << std::endl;
+}
@@ -0,0 +1,93 @@
+#ifndef REALTIME_RUNTIME_H
+#define REALTIME_RUNTIME_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <thread>
+#include <vector>
+#include "LadderLogicParser.h"
+#include "LogRing.h"
+#include "TagDatabase.h"
+
+struct RealtimeOptions {
+    int cpu = -1; // core the scan thread is pinned to, -1 leaves it unpinned
+    int priority = 80; // SCHED_FIFO priority, 0 keeps the normal scheduler
+    int periodMicroseconds = 10000;
+    long long scanLimit = 0; // 0 runs until interrupted
+    long long maxLatency = 0; // in microseconds, worst wakeup latency that still passes, 0 means no limit
+};
+
+// Min/avg/max of a microsecond measurement, with a log2 histogram like cyclictest's
+struct LatencyStats {
+    static constexpr int Buckets = 16; // bucket n counts values below 2^n us, the last one everything above
+
+    long long samples = 0;
+    long long minimum = 0;
+    long long maximum = 0;
+    long long total = 0;
+    long long histogram[Buckets] = {};
+
+    void add(long long value);
+    void print(std::ostream& out, const char* title) const;
+};
+
+// Stands in for the buffer of std::cout or std::cerr during a real-time run. Output of the thread that called
+// routeToRing() goes into that ring, which a logger thread writes to the real stdout, so the scan never blocks on
+// the terminal. Output of any other thread (message workers, publisher, debugger) goes to the console as before,
+// so the ring keeps its single producer.
+class ConsoleRouter : public std::streambuf {
+public:
+    explicit ConsoleRouter(std::streambuf* console) : console(console) {}
+    std::streambuf* consoleBuffer() const { return console; }
+
+    static void routeToRing(LogRing* ring); // for the calling thread, nullptr ends it
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize count) override;
+    int sync() override;
+
+private:
+    std::streambuf* console;
+};
+
+// Runs the scan periodically on a dedicated core: pinned, SCHED_FIFO, with all memory locked and pre-faulted so
+// the scan never takes a page fault, and all console output handed to a non real-time logger thread.
+// Anything the system does not allow (usually EPERM without CAP_SYS_NICE/CAP_IPC_LOCK) is reported and skipped.
+class RealtimeRuntime {
+public:
+    RealtimeRuntime(LadderLogicParser& parser, TagDatabase& tags, const RealtimeOptions& options);
+
+    bool run(); // false if the worst wakeup latency was above maxLatency
+    bool selfCheck(); // the same periodic loop without the logic, like cyclictest
+
+    LatencyStats wakeupLatency; // how late each wakeup was
+    LatencyStats scanDuration;
+    long long scans = 0;
+    long long overruns = 0; // scans that did not finish before the next period
+
+private:
+    LadderLogicParser& parser;
+    TagDatabase& tags;
+    RealtimeOptions options;
+    LogRing log;
+    std::thread logger;
+    std::unique_ptr<ConsoleRouter> consoleOut;
+    std::unique_ptr<ConsoleRouter> consoleErr;
+    std::atomic<bool> loggerRunning{false};
+    bool pinned = false;
+    bool fifo = false;
+    bool locked = false;
+
+    bool periodicLoop(bool executeLogic);
+    void configureThread();
+    void prefault(bool executeLogic);
+    void startLogger();
+    void stopLogger();
+    void printReport(std::ostream& out, bool executeLogic) const;
+};
+
+#endif // REALTIME_RUNTIME_H
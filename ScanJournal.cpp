@@ -0,0 +1,235 @@
+#include "ScanJournal.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+#include "LadderLogicParser.h"
+
+ScanJournal::ScanJournal(TagDatabase& tags) :
+    tags(tags),
+    // Room for a few whole images, so a burst of changes does not force a drop straight away
+    ring(std::max<size_t>(size_t(1) << 22, 4 * (tags.imageSize() / WordSize + 1) * (MaxVarint + WordSize))) {
+    size_t words = (tags.imageSize() + WordSize - 1) / WordSize;
+    previous.assign(words * WordSize, 0);
+    record.resize(4 * MaxVarint + words * (MaxVarint + WordSize));
+}
+
+ScanJournal::~ScanJournal() {
+    close();
+}
+
+bool ScanJournal::open(const std::string& filename) {
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Could not open journal " << filename << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    char header[8] = {'L', 'L', 'J', '2'};
+    uint32_t imageSize = tags.imageSize();
+    std::memcpy(header + 4, &imageSize, sizeof(imageSize));
+    if (::write(fd, header, sizeof(header)) != sizeof(header)) {
+        std::cerr << "Could not write journal " << filename << std::endl;
+        return false;
+    }
+    written.store(sizeof(header));
+
+    writing.store(true);
+    writer = std::thread(&ScanJournal::writeLoop, this);
+    return true;
+}
+
+void ScanJournal::close() {
+    if (writing.exchange(false)) {
+        writer.join();
+    }
+    if (fd >= 0) {
+        written.fetch_add(ring.drain(fd));
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void ScanJournal::writeLoop() {
+    while (writing.load(std::memory_order_relaxed)) {
+        written.fetch_add(ring.drain(fd), std::memory_order_relaxed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void ScanJournal::addVarint(uint64_t value) {
+    while (value >= 0x80) {
+        record[length++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    record[length++] = static_cast<char>(value);
+}
+
+void ScanJournal::addWord(size_t& lastWord, size_t word, const uint8_t* value) {
+    addVarint(word + 1 - lastWord);
+    std::memcpy(record.data() + length, value, WordSize);
+    length += WordSize;
+    lastWord = word + 1;
+}
+
+void ScanJournal::reserveMessages(size_t slots, size_t bytes) {
+    record.resize(record.size() + slots * 4 * MaxVarint + bytes);
+}
+
+void ScanJournal::scanStart(int scanTime) {
+    const uint8_t* image = tags.data();
+    size_t size = tags.imageSize();
+
+    int64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    int32_t scanTimeChange = scanTime - lastScanTime;
+    length = 0;
+    overflow = false;
+    addVarint(timestamp - lastTimestamp);
+    addVarint((static_cast<uint32_t>(scanTimeChange) << 1) ^ static_cast<uint32_t>(scanTimeChange >> 31));
+
+    // Most scans see no outside writes at all, one memcmp settles that
+    if (keyframe || std::memcmp(image, previous.data(), size) != 0) {
+        size_t lastWord = 0;
+        size_t whole = size / WordSize * WordSize;
+        for (size_t offset = 0; offset < whole; offset += WordSize) {
+            uint64_t now, before;
+            std::memcpy(&now, image + offset, WordSize);
+            std::memcpy(&before, previous.data() + offset, WordSize);
+            if (keyframe || now != before) {
+                addWord(lastWord, offset / WordSize, image + offset);
+            }
+        }
+        if (whole < size) {
+            // The last word is padded with zeroes
+            uint8_t tail[WordSize] = {};
+            std::memcpy(tail, image + whole, size - whole);
+            if (keyframe || std::memcmp(tail, previous.data() + whole, WordSize) != 0) {
+                addWord(lastWord, whole / WordSize, tail);
+            }
+        }
+    }
+    addVarint(0);
+    recordTimestamp = timestamp;
+    recordScanTime = scanTime;
+}
+
+void ScanJournal::messageCompleted(size_t slot, const MessageRecord& message, std::span<const uint8_t> data) {
+    // The end of the record needs one more varint
+    if (overflow || length + 4 * MaxVarint + data.size() + MaxVarint > record.size()) {
+        overflow = true;
+        return;
+    }
+    addVarint(slot + 1);
+    addVarint(static_cast<uint32_t>(message.err));
+    addVarint(static_cast<uint32_t>(message.len));
+    addVarint(data.size());
+    std::memcpy(record.data() + length, data.data(), data.size());
+    length += data.size();
+}
+
+void ScanJournal::scanEnd() {
+    // The record goes out once the scan has run, with the MSG completions it picked up
+    addVarint(0);
+    long long dropped = ring.dropped();
+    if (!overflow) {
+        ring.sputn(record.data(), length);
+    }
+    if (overflow || ring.dropped() != dropped) {
+        ++droppedRecords;
+        keyframe = true;
+    } else {
+        ++records;
+        keyframe = false;
+        lastTimestamp = recordTimestamp;
+        lastScanTime = recordScanTime;
+    }
+
+    std::memcpy(previous.data(), tags.data(), tags.imageSize());
+}
+
+bool ScanJournal::replay(const std::string& filename, LadderLogicParser& parser, TagDatabase& tags, ReplayResult& result) {
+    std::ifstream file(filename, std::ios::binary);
+    char header[8];
+    if (!file.read(header, sizeof(header)) || std::memcmp(header, "LLJ2", 4) != 0) {
+        std::cerr << "Not a scan journal of this version: " << filename << std::endl;
+        return false;
+    }
+    uint32_t imageSize;
+    std::memcpy(&imageSize, header + 4, sizeof(imageSize));
+    if (imageSize != tags.imageSize()) {
+        std::cerr << "The journal was recorded with other variables: an image of " << imageSize << " bytes, these take "
+                  << tags.imageSize() << std::endl;
+        return false;
+    }
+
+    // Records are small and many, read them through the stream buffer a byte at a time
+    std::streambuf& in = *file.rdbuf();
+    auto readVarint = [&in](uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = in.sbumpc();
+            if (byte == std::char_traits<char>::eof()) {
+                return false;
+            }
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // The MSG requests complete with what they read or received in the recording, nothing is read or sent again
+    MessageExecutor& messages = parser.messageExecutor();
+    messages.replayOnly();
+    std::vector<uint8_t> data;
+
+    int64_t timestamp = 0;
+    int32_t scanTime = 0;
+    uint64_t timeChange, scanTimeChange;
+    while (readVarint(timeChange)) {
+        bool complete = readVarint(scanTimeChange);
+        timestamp += timeChange;
+        scanTime += static_cast<int32_t>((scanTimeChange >> 1) ^ -(scanTimeChange & 1));
+
+        uint64_t word = 0, wordChange;
+        while (complete && (complete = readVarint(wordChange)) && wordChange != 0) {
+            word += wordChange;
+            size_t offset = (word - 1) * WordSize;
+            char value[WordSize];
+            complete = in.sgetn(value, WordSize) == WordSize;
+            if (complete && offset < imageSize) {
+                std::memcpy(tags.data() + offset, value, std::min<size_t>(WordSize, imageSize - offset));
+            }
+        }
+
+        uint64_t slot, error, messageLength, bytes;
+        while (complete && (complete = readVarint(slot)) && slot != 0) {
+            complete = readVarint(error) && readVarint(messageLength) && readVarint(bytes);
+            if (complete && bytes <= messages.bufferBytes()) {
+                data.resize(bytes);
+                complete = in.sgetn(reinterpret_cast<char*>(data.data()), bytes) == static_cast<std::streamsize>(bytes);
+            }
+            if (complete && (bytes > messages.bufferBytes() || !messages.complete(slot - 1, error, messageLength, data))) {
+                std::cerr << "The journal was recorded with other MSG instructions, slot " << slot - 1 << " does not fit" << std::endl;
+                return false;
+            }
+        }
+        if (!complete) {
+            // The recording process stopped in the middle of writing this record
+            std::cerr << "The journal ends with an incomplete record, replay stops there" << std::endl;
+            break;
+        }
+
+        parser.executeLogic(scanTime);
+        if (result.scans++ == 0) {
+            result.firstTimestamp = timestamp;
+        }
+        result.lastTimestamp = timestamp;
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef SCAN_JOURNAL_H
+#define SCAN_JOURNAL_H
+
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+#include "LogRing.h"
+#include "TagDatabase.h"
+
+class LadderLogicParser;
+
+struct ReplayResult {
+    long long scans = 0;
+    long long firstTimestamp = 0; // microseconds since the epoch, when the first and last replayed scans were recorded
+    long long lastTimestamp = 0;
+};
+
+// Records what the logic cannot compute itself, so a run can be replayed scan for scan: the time each scan
+// started, the scan time its timers advanced by, and every 8 byte word of the tag image that changed between the
+// end of one scan and the start of the next (I/O, debugger commands run between scans, another program). The
+// first record holds the whole image. What each MSG request read or received is recorded when the MSG picks it
+// up, and replay hands it back so the MSG picks it up in the same scan, with message I/O turned off.
+//
+// Other writes made in the middle of a scan are not recorded, so replay differs from the run where they were used:
+// debugger forces put back after each instruction that writes a forced tag, and alarm acknowledgements, which
+// only change the alarm engine's state and events.
+//
+// Records are built on the scan thread into a preallocated buffer and handed to a writer thread through a LogRing,
+// so the scan neither allocates nor waits for the disk. A record that does not fit in the ring is dropped and
+// counted, and the next one is written as a whole image again so the replayed tags are exact again from there on.
+// The MSG completions of a dropped record are lost.
+//
+// File format: "LLJ2", uint32 image size, then one record per scan made of unsigned LEB128 varints, so a scan
+// without outside writes at a steady rate takes about four bytes:
+//   start time in microseconds, since the epoch for the first record and since the previous record after that
+//   scan time in microseconds, zigzag encoded difference from the previous record
+//   per changed word: index difference from the previous word (the first: index + 1) and the 8 bytes
+//   0, which ends the words
+//   per MSG request that completed in the scan: slot + 1, ERR, LEN, the number of data bytes and the bytes
+//   0, which ends the record
+class ScanJournal {
+public:
+    explicit ScanJournal(TagDatabase& tags);
+    ~ScanJournal();
+
+    bool open(const std::string& filename);
+    void close();
+
+    // Called by the parser
+    void scanStart(int scanTime);
+    void scanEnd();
+    void reserveMessages(size_t slots, size_t bytes); // room in a record for one completion of every MSG slot
+    void messageCompleted(size_t slot, const MessageRecord& record, std::span<const uint8_t> data);
+
+    long long records = 0;
+    long long droppedRecords = 0;
+    long long bytesWritten() const { return written.load(std::memory_order_relaxed); }
+
+    // Runs every recorded scan through the parser as fast as possible, false if the file does not fit the tags
+    static bool replay(const std::string& filename, LadderLogicParser& parser, TagDatabase& tags, ReplayResult& result);
+
+private:
+    static constexpr size_t WordSize = 8;
+    static constexpr size_t MaxVarint = 10;
+
+    TagDatabase& tags;
+    std::vector<uint8_t> previous; // the image at the end of the last scan, padded to whole words
+    std::vector<char> record;
+    size_t length = 0; // of the record being built
+    bool overflow = false; // more MSG completions than the record has room for, it is dropped
+    bool keyframe = true;
+    int64_t recordTimestamp = 0; // of the record being built
+    int32_t recordScanTime = 0;
+    int64_t lastTimestamp = 0; // of the last record written, the next one is encoded relative to it
+    int32_t lastScanTime = 0;
+    LogRing ring;
+    int fd = -1;
+    std::thread writer;
+    std::atomic<bool> writing{false};
+    std::atomic<long long> written{0};
+
+    void addVarint(uint64_t value);
+    void addWord(size_t& lastWord, size_t word, const uint8_t* value);
+    void writeLoop();
+};
+
+#endif // SCAN_JOURNAL_H
@@ -0,0 +1,507 @@
+#include "TagDatabase.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+const char* dataTypeName(DataType type) {
+    switch (type) {
+        case DataType::BOOL: return "BOOL";
+        case DataType::SINT: return "SINT";
+        case DataType::INT: return "INT";
+        case DataType::DINT: return "DINT";
+        case DataType::LINT: return "LINT";
+        case DataType::REAL: return "REAL";
+        case DataType::LREAL: return "LREAL";
+        case DataType::STRUCT: return "STRUCT";
+    }
+    return "?";
+}
+
+bool parseDataType(const std::string& text, DataType& type) {
+    for (const auto& entry : dataTypeNames) {
+        if (entry.name == text) {
+            type = entry.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t dataTypeSize(DataType type) {
+    switch (type) {
+        case DataType::BOOL: return 0;
+        case DataType::SINT: return 1;
+        case DataType::INT: return 2;
+        case DataType::DINT: return 4;
+        case DataType::LINT: return 8;
+        case DataType::REAL: return 4;
+        case DataType::LREAL: return 8;
+        case DataType::STRUCT: return 0;
+    }
+    return 0;
+}
+
+bool isIntegerType(DataType type) {
+    return type == DataType::SINT || type == DataType::INT || type == DataType::DINT || type == DataType::LINT;
+}
+
+TagDatabase::TagDatabase() {
+    for (const auto& builtIn : builtInStructs) {
+        std::vector<std::pair<std::string, DataType>> members;
+        for (const auto& member : builtIn.members) {
+            members.emplace_back(member.name, member.type);
+        }
+        defineStruct(std::string(builtIn.name), members);
+    }
+    static_assert(sizeof(TimerRecord) == 12 && sizeof(CounterRecord) == 12 && sizeof(PidRecord) == 40 && sizeof(MessageRecord) == 12,
+                  "built-in records must match their struct layout");
+}
+
+bool TagDatabase::defineStruct(const std::string& name, const std::vector<std::pair<std::string, DataType>>& members) {
+    uint16_t existing;
+    if (findStruct(name, existing)) {
+        std::cerr << "Type defined twice: " << name << std::endl;
+        return false;
+    }
+
+    StructType structType;
+    structType.name = name;
+    for (const auto& [memberName, type] : members) {
+        if (type == DataType::STRUCT) {
+            std::cerr << "Type " << name << ": member " << memberName << " must be an elementary type" << std::endl;
+            return false;
+        }
+        structType.members.push_back(StructMember{memberName, type, 0});
+    }
+
+    // Same rules as the tag image: largest members first, then the BOOLs packed eight to a byte
+    std::vector<size_t> order(structType.members.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&structType](size_t a, size_t b) {
+        return dataTypeSize(structType.members[a].type) > dataTypeSize(structType.members[b].type);
+    });
+
+    uint32_t size = 0;
+    uint32_t bit = 0;
+    for (size_t i : order) {
+        StructMember& member = structType.members[i];
+        uint32_t memberSize = dataTypeSize(member.type);
+        if (member.type == DataType::BOOL) {
+            member.offset = size * 8 + bit++;
+        } else {
+            member.offset = size;
+            size += memberSize;
+            structType.alignment = std::max(structType.alignment, memberSize);
+        }
+    }
+    size += (bit + 7) / 8;
+    structType.size = (size + structType.alignment - 1) / structType.alignment * structType.alignment;
+
+    structTypes.push_back(structType);
+    return true;
+}
+
+bool TagDatabase::findStruct(const std::string& name, uint16_t& structType) const {
+    for (size_t i = 0; i < structTypes.size(); ++i) {
+        if (structTypes[i].name == name) {
+            structType = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TagDatabase::declare(const std::string& name, DataType type, const std::string& initialValue, uint16_t structType, uint32_t count) {
+    if (index.count(name)) {
+        std::cerr << "Tag declared twice: " << name << std::endl;
+        return false;
+    }
+    if (count != 1 && (type == DataType::BOOL || type == DataType::STRUCT || count == 0)) {
+        std::cerr << "Arrays must have at least one element of a numeric type: " << name << std::endl;
+        return false;
+    }
+
+    Tag tag{name, type, TagRef{}, initialValue};
+    tag.ref.type = type;
+    tag.ref.structType = structType;
+    tag.ref.count = count;
+    index[name] = tags.size();
+    tags.push_back(tag);
+
+    // Once the image is laid out, new tags go on the end
+    if (laidOut) {
+        tags.back().ref = allocate(type, structType, count);
+        return applyInitialValue(tags.back());
+    }
+    return true;
+}
+
+void TagDatabase::layout() {
+    if (laidOut) {
+        return;
+    }
+    laidOut = true;
+
+    // Largest types first keeps every tag naturally aligned without padding
+    std::vector<size_t> order(tags.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    auto alignment = [this](size_t i) {
+        return tags[i].type == DataType::STRUCT ? structTypes[tags[i].ref.structType].alignment : dataTypeSize(tags[i].type);
+    };
+    std::stable_sort(order.begin(), order.end(), [&alignment](size_t a, size_t b) {
+        return alignment(a) > alignment(b);
+    });
+
+    for (size_t i : order) {
+        tags[i].ref = allocate(tags[i].type, tags[i].ref.structType, tags[i].ref.count);
+    }
+    for (const auto& tag : tags) {
+        applyInitialValue(tag);
+    }
+}
+
+TagRef TagDatabase::allocate(DataType type, uint16_t structType, uint32_t count) {
+    TagRef ref;
+    ref.type = type;
+    ref.structType = structType;
+    ref.count = count;
+
+    if (type == DataType::BOOL) {
+        if (nextBit == 0) {
+            nextBit = image.size() * 8;
+            image.push_back(0);
+        }
+        ref.offset = nextBit++;
+        if (nextBit % 8 == 0) {
+            nextBit = 0;
+        }
+        return ref;
+    }
+
+    size_t alignment = type == DataType::STRUCT ? structTypes[structType].alignment : dataTypeSize(type);
+    size_t size = type == DataType::STRUCT ? structTypes[structType].size : dataTypeSize(type) * count;
+    size_t offset = (image.size() + alignment - 1) / alignment * alignment;
+    image.resize(offset + size, 0);
+    ref.offset = offset;
+    // A BOOL byte that is now followed by other data cannot be extended any more
+    nextBit = 0;
+    return ref;
+}
+
+bool TagDatabase::applyInitialValue(const Tag& tag) {
+    if (tag.initialValue.empty()) {
+        return true;
+    }
+
+    if (tag.ref.count > 1) {
+        // Arrays take one value for every element, or a comma separated list from the first element on
+        std::vector<std::string> values;
+        std::istringstream iss(tag.initialValue);
+        std::string value;
+        while (std::getline(iss, value, ',')) {
+            values.push_back(value);
+        }
+        if (values.size() > tag.ref.count) {
+            std::cerr << "Too many initial values for " << tag.name << std::endl;
+            return false;
+        }
+        TagRef element = tag.ref;
+        element.count = 1;
+        size_t size = dataTypeSize(tag.type);
+        for (uint32_t i = 0; i < tag.ref.count; ++i) {
+            if (values.size() > 1 && i >= values.size()) {
+                break;
+            }
+            element.offset = tag.ref.offset + i * size;
+            if (!applyValue(element, values.size() == 1 ? values[0] : values[i])) {
+                std::cerr << "Invalid initial value for " << tag.name << ": " << tag.initialValue << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (tag.type != DataType::STRUCT) {
+        if (applyValue(tag.ref, tag.initialValue)) {
+            return true;
+        }
+        std::cerr << "Invalid initial value for " << tag.name << ": " << tag.initialValue << std::endl;
+        return false;
+    }
+
+    // Records are initialised member by member, e.g. PRE=10000,ACC=0
+    std::istringstream iss(tag.initialValue);
+    std::string assignment;
+    bool ok = true;
+    while (std::getline(iss, assignment, ',')) {
+        size_t equals = assignment.find('=');
+        TagRef member = equals == std::string::npos ? TagRef{} : find(tag.name + "." + assignment.substr(0, equals));
+        if (!member || !applyValue(member, assignment.substr(equals + 1))) {
+            std::cerr << "Invalid initial value for " << tag.name << ": " << assignment << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool TagDatabase::applyValue(TagRef ref, const std::string& text) {
+    std::istringstream iss(text);
+    if (ref.type == DataType::REAL || ref.type == DataType::LREAL) {
+        double value;
+        if (iss >> value) {
+            set(ref, value);
+            return true;
+        }
+    } else if (text == "true" || text == "false") {
+        set(ref, text == "true");
+        return true;
+    } else {
+        long long value;
+        if (iss >> value) {
+            set(ref, value);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TagDatabase::loadFromFile(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Failed to open " << filename << std::endl;
+        return false;
+    }
+
+    // Lines are "name type value" or "VAR name type value".
+    // "TYPE name member:TYPE member:TYPE ..." defines a structured type for the lines after it.
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string name, typeName, value;
+        iss >> name;
+        if (name == "TYPE") {
+            std::string member;
+            std::vector<std::pair<std::string, DataType>> members;
+            iss >> name;
+            while (iss >> member) {
+                size_t colon = member.find(':');
+                DataType type;
+                if (colon == std::string::npos || !parseDataType(member.substr(colon + 1), type)) {
+                    std::cerr << "Invalid member in type " << name << ": " << member << std::endl;
+                    continue;
+                }
+                members.emplace_back(member.substr(0, colon), type);
+            }
+            defineStruct(name, members);
+            continue;
+        }
+        if (name == "VAR") {
+            iss >> name;
+        }
+        iss >> typeName >> value;
+        if (name.empty()) {
+            continue;
+        }
+
+        // Arrays are written REAL[1024]
+        uint32_t count = 1;
+        size_t bracket = typeName.find('[');
+        if (bracket != std::string::npos) {
+            count = std::strtoul(typeName.c_str() + bracket + 1, nullptr, 10);
+            typeName = typeName.substr(0, bracket);
+        }
+
+        DataType type;
+        uint16_t structType = 0;
+        if (findStruct(typeName, structType)) {
+            type = DataType::STRUCT;
+        } else if (!parseDataType(typeName, type)) {
+            std::cerr << "Unknown data type for " << name << ": " << typeName << std::endl;
+            continue;
+        }
+        declare(name, type, value, structType, count);
+    }
+    layout();
+    return true;
+}
+
+bool TagDatabase::saveToFile(const std::string& filename) const {
+    std::ofstream file(filename);
+    if (!file) {
+        std::cerr << "Failed to open " << filename << std::endl;
+        return false;
+    }
+    for (size_t i = MessageType + 1; i < structTypes.size(); ++i) {
+        file << "TYPE " << structTypes[i].name;
+        for (const auto& member : structTypes[i].members) {
+            file << " " << member.name << ":" << dataTypeName(member.type);
+        }
+        file << "\n";
+    }
+    for (const auto& [name, i] : index) {
+        const Tag& tag = tags[i];
+        if (tag.type == DataType::STRUCT) {
+            file << name << " " << structTypes[tag.ref.structType].name << " ";
+            printRecord(file, tag.ref, ",");
+        } else if (tag.type == DataType::BOOL) {
+            file << name << " " << dataTypeName(tag.type) << " " << getBool(tag.ref);
+        } else if (tag.ref.count > 1) {
+            file << name << " " << typeName(tag) << " ";
+            printElements(file, tag.ref, tag.ref.count);
+        } else {
+            file << name << " " << dataTypeName(tag.type) << " ";
+            printValue(file, tag.ref);
+        }
+        file << "\n";
+    }
+    return true;
+}
+
+TagRef TagDatabase::find(const std::string& name) const {
+    size_t bracket = name.find('[');
+    if (bracket != std::string::npos) {
+        return findElements(name, bracket);
+    }
+
+    size_t dot = name.find('.');
+    auto it = index.find(dot == std::string::npos ? name : name.substr(0, dot));
+    if (it == index.end()) {
+        return TagRef{};
+    }
+    const TagRef& ref = tags[it->second].ref;
+    if (dot == std::string::npos) {
+        return ref;
+    }
+
+    if (ref.type != DataType::STRUCT || !ref) {
+        return TagRef{};
+    }
+    std::string memberName = name.substr(dot + 1);
+    for (const auto& member : structTypes[ref.structType].members) {
+        if (member.name == memberName) {
+            TagRef memberRef;
+            memberRef.type = member.type;
+            memberRef.offset = member.type == DataType::BOOL ? ref.offset * 8 + member.offset : ref.offset + member.offset;
+            return memberRef;
+        }
+    }
+    return TagRef{};
+}
+
+TagRef TagDatabase::findElements(const std::string& name, size_t bracket) const {
+    auto it = index.find(name.substr(0, bracket));
+    if (it == index.end() || name.back() != ']') {
+        return TagRef{};
+    }
+    TagRef ref = tags[it->second].ref;
+    if (ref.count == 1 || !ref) {
+        return TagRef{};
+    }
+
+    // "array[i]" is one element, "array[first:end]" the elements from first up to but not including end
+    std::string range = name.substr(bracket + 1, name.size() - bracket - 2);
+    size_t colon = range.find(':');
+    char* parsed;
+    unsigned long first = std::strtoul(range.c_str(), &parsed, 10);
+    unsigned long end = first + 1;
+    if (colon != std::string::npos) {
+        end = std::strtoul(range.c_str() + colon + 1, &parsed, 10);
+    }
+    if (range.empty() || *parsed != '\0' || first >= end || end > ref.count) {
+        return TagRef{};
+    }
+
+    ref.offset += first * dataTypeSize(ref.type);
+    ref.count = end - first;
+    return ref;
+}
+
+size_t TagDatabase::sizeOf(TagRef ref) const {
+    if (ref.type == DataType::STRUCT) {
+        return structTypes[ref.structType].size;
+    }
+    return ref.type == DataType::BOOL ? 1 : dataTypeSize(ref.type) * ref.count;
+}
+
+bool TagDatabase::overlaps(TagRef a, TagRef b) const {
+    uint32_t firstA = a.type == DataType::BOOL ? a.offset / 8 : a.offset;
+    uint32_t firstB = b.type == DataType::BOOL ? b.offset / 8 : b.offset;
+    return firstA < firstB + sizeOf(b) && firstB < firstA + sizeOf(a);
+}
+
+void TagDatabase::printValue(std::ostream& out, TagRef ref) const {
+    if (ref.count > 1) {
+        // Long arrays would drown the console, only the start is shown
+        out << "[";
+        printElements(out, ref, 8);
+        out << "]";
+        return;
+    }
+    switch (ref.type) {
+        case DataType::BOOL: out << (getBool(ref) ? "true" : "false"); break;
+        case DataType::REAL: out << get<float>(ref); break;
+        case DataType::LREAL: out << get<double>(ref); break;
+        case DataType::STRUCT: out << "{"; printRecord(out, ref, ", "); out << "}"; break;
+        default: out << get<long long>(ref); break;
+    }
+}
+
+void TagDatabase::printElements(std::ostream& out, TagRef ref, size_t limit) const {
+    TagRef element = ref;
+    element.count = 1;
+    for (uint32_t i = 0; i < ref.count && i < limit; ++i) {
+        element.offset = ref.offset + i * dataTypeSize(ref.type);
+        out << (i > 0 ? "," : "");
+        printValue(out, element);
+    }
+    if (ref.count > limit) {
+        out << ",... (" << ref.count << " elements)";
+    }
+}
+
+std::string TagDatabase::typeName(const Tag& tag) const {
+    if (tag.type == DataType::STRUCT) {
+        return structTypes[tag.ref.structType].name;
+    }
+    if (tag.ref.count > 1) {
+        return std::string(dataTypeName(tag.type)) + "[" + std::to_string(tag.ref.count) + "]";
+    }
+    return dataTypeName(tag.type);
+}
+
+void TagDatabase::printRecord(std::ostream& out, TagRef ref, const char* separator) const {
+    const auto& members = structTypes[ref.structType].members;
+    for (size_t i = 0; i < members.size(); ++i) {
+        TagRef memberRef;
+        memberRef.type = members[i].type;
+        memberRef.offset = members[i].type == DataType::BOOL ? ref.offset * 8 + members[i].offset : ref.offset + members[i].offset;
+        out << (i > 0 ? separator : "") << members[i].name << "=";
+        printValue(out, memberRef);
+    }
+}
+
+void TagDatabase::printMemoryReport(std::ostream& out) const {
+    size_t bits = 0;
+    for (const auto& [name, i] : index) {
+        const Tag& tag = tags[i];
+        out << std::left << std::setw(24) << name << std::setw(12) << typeName(tag);
+        if (tag.type == DataType::STRUCT) {
+            out << structTypes[tag.ref.structType].size << " bytes  at byte " << tag.ref.offset;
+        } else if (tag.type == DataType::BOOL) {
+            out << "1 bit    at byte " << tag.ref.offset / 8 << " bit " << tag.ref.offset % 8;
+            ++bits;
+        } else {
+            out << sizeOf(tag.ref) << " bytes  at byte " << tag.ref.offset;
+        }
+        out << std::right << std::endl;
+    }
+    out << "Tags: " << tags.size() << " (" << bits << " BOOLs)" << std::endl;
+    out << "Tag image: " << image.size() << " bytes" << std::endl;
+}
@@ -0,0 +1,261 @@
+#ifndef TAG_DATABASE_H
+#define TAG_DATABASE_H
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// IEC 61131-3 elementary types, stored at their native size in the tag image.
+// STRUCT tags are records of elementary members, see StructType.
+enum class DataType : uint8_t { BOOL, SINT, INT, DINT, LINT, REAL, LREAL, STRUCT };
+
+const char* dataTypeName(DataType type);
+bool parseDataType(const std::string& text, DataType& type);
+
+// The type names parseDataType accepts.
+// Lower case names are the original variables.txt types and keep their original sizes.
+struct DataTypeName {
+    std::string_view name;
+    DataType type;
+};
+
+inline constexpr DataTypeName dataTypeNames[] = {
+    {"BOOL", DataType::BOOL}, {"SINT", DataType::SINT}, {"INT", DataType::INT}, {"DINT", DataType::DINT},
+    {"LINT", DataType::LINT}, {"REAL", DataType::REAL}, {"LREAL", DataType::LREAL},
+    {"bool", DataType::BOOL}, {"int", DataType::DINT}, {"real", DataType::LREAL},
+};
+size_t dataTypeSize(DataType type); // in bytes, 0 for BOOL which takes a single bit and for STRUCT
+bool isIntegerType(DataType type);
+
+// Calls function with a value of the C++ type that stores a numeric DataType
+template <typename Function>
+void forNumericType(DataType type, Function function) {
+    switch (type) {
+        case DataType::SINT: function(int8_t()); break;
+        case DataType::INT: function(int16_t()); break;
+        case DataType::DINT: function(int32_t()); break;
+        case DataType::LINT: function(int64_t()); break;
+        case DataType::REAL: function(float()); break;
+        case DataType::LREAL: function(double()); break;
+        case DataType::BOOL:
+        case DataType::STRUCT: throw std::invalid_argument(std::string("not a numeric type: ") + dataTypeName(type));
+    }
+}
+
+// Where a tag lives in the tag image. BOOLs are addressed by bit, everything else by byte.
+// Arrays, and slices of them, are count elements of type stored one after the other.
+struct TagRef {
+    DataType type = DataType::BOOL;
+    uint16_t structType = 0; // see TagDatabase::structType(), for STRUCT tags only
+    uint32_t offset = UINT32_MAX;
+    uint32_t count = 1; // elements, 1 for scalars
+
+    explicit operator bool() const { return offset != UINT32_MAX; }
+};
+
+struct Tag {
+    std::string name;
+    DataType type;
+    TagRef ref;
+    std::string initialValue;
+};
+
+// A member of a structured type. The offset is in bytes from the start of the record, or in bits for BOOLs.
+struct StructMember {
+    std::string name;
+    DataType type;
+    uint32_t offset;
+};
+
+// A structured type, laid out like the tag image: largest members first, BOOLs packed at the end
+struct StructType {
+    std::string name;
+    std::vector<StructMember> members;
+    uint32_t size = 0;
+    uint32_t alignment = 1;
+};
+
+// The members of the built-in structured types, in the order TagDatabase defines them (TimerType, CounterType, ...)
+struct BuiltInMember {
+    std::string_view name;
+    DataType type;
+};
+
+struct BuiltInStruct {
+    std::string_view name;
+    std::span<const BuiltInMember> members;
+};
+
+inline constexpr BuiltInMember timerMembers[] = {
+    {"PRE", DataType::DINT}, {"ACC", DataType::DINT}, {"EN", DataType::BOOL}, {"TT", DataType::BOOL}, {"DN", DataType::BOOL}};
+inline constexpr BuiltInMember counterMembers[] = {
+    {"PRE", DataType::DINT}, {"ACC", DataType::DINT}, {"CU", DataType::BOOL}, {"CD", DataType::BOOL},
+    {"DN", DataType::BOOL}, {"OV", DataType::BOOL}, {"UN", DataType::BOOL}};
+inline constexpr BuiltInMember pidMembers[] = {
+    {"SP", DataType::REAL}, {"PV", DataType::REAL}, {"CV", DataType::REAL}, {"KP", DataType::REAL}, {"KI", DataType::REAL},
+    {"KD", DataType::REAL}, {"TF", DataType::REAL}, {"CVMIN", DataType::REAL}, {"CVMAX", DataType::REAL},
+    {"EN", DataType::BOOL}, {"SAT", DataType::BOOL}};
+inline constexpr BuiltInMember messageMembers[] = {
+    {"ERR", DataType::DINT}, {"LEN", DataType::DINT}, {"EN", DataType::BOOL}, {"DN", DataType::BOOL}, {"ER", DataType::BOOL}};
+inline constexpr BuiltInStruct builtInStructs[] = {
+    {"TIMER", timerMembers}, {"COUNTER", counterMembers}, {"PID", pidMembers}, {"MESSAGE", messageMembers}};
+
+// The built-in TIMER and COUNTER records, so instructions can load and store a whole record at once.
+// The member layout TagDatabase gives these types matches these structs exactly.
+struct TimerRecord {
+    int32_t pre;
+    int32_t acc;
+    uint8_t bits; // EN, TT, DN
+};
+
+struct CounterRecord {
+    int32_t pre;
+    int32_t acc;
+    uint8_t bits; // CU, CD, DN, OV, UN
+};
+
+// The built-in PID loop. The loop's internal state (integral, filtered derivative) is kept by the PID engine.
+struct PidRecord {
+    float sp;
+    float pv;
+    float cv;
+    float kp;
+    float ki; // integral gain, per second
+    float kd; // derivative gain, in seconds
+    float tf; // derivative filter time constant, in seconds
+    float cvMin;
+    float cvMax;
+    uint8_t bits; // EN, SAT
+};
+
+enum TimerBits : uint8_t { TimerEN = 1, TimerTT = 2, TimerDN = 4 };
+enum CounterBits : uint8_t { CounterCU = 1, CounterCD = 2, CounterDN = 4, CounterOV = 8, CounterUN = 16 };
+// The built-in MESSAGE control record of the MSG instruction
+struct MessageRecord {
+    int32_t err; // errno of a failed request
+    int32_t len; // elements or bytes transferred
+    uint8_t bits; // EN, DN, ER
+};
+
+enum PidBits : uint8_t { PidEN = 1, PidSAT = 2 };
+enum MessageBits : uint8_t { MessageEN = 1, MessageDN = 2, MessageER = 4 };
+
+// All tags of a program, packed into one contiguous image.
+// Tags are declared first and placed by layout(), largest first so nothing needs padding, with the BOOLs packed
+// eight to a byte at the end. Tags declared after layout() are appended, so existing TagRefs stay valid.
+class TagDatabase {
+public:
+    static constexpr uint16_t TimerType = 0;
+    static constexpr uint16_t CounterType = 1;
+    static constexpr uint16_t PidType = 2;
+    static constexpr uint16_t MessageType = 3;
+
+    TagDatabase();
+    bool defineStruct(const std::string& name, const std::vector<std::pair<std::string, DataType>>& members);
+    bool findStruct(const std::string& name, uint16_t& structType) const;
+    const StructType& structType(uint16_t i) const { return structTypes[i]; }
+
+    bool declare(const std::string& name, DataType type, const std::string& initialValue, uint16_t structType = 0, uint32_t count = 1);
+    void layout();
+    bool loadFromFile(const std::string& filename);
+    bool saveToFile(const std::string& filename) const;
+
+    TagRef find(const std::string& name) const; // "tag", "tag.MEMBER", "array[i]" or the slice "array[first:end]"
+    size_t sizeOf(TagRef ref) const; // in bytes, a BOOL counts as its whole byte
+    bool overlaps(TagRef a, TagRef b) const;
+    const std::map<std::string, size_t>& names() const { return index; }
+    const Tag& tag(size_t i) const { return tags[i]; }
+    size_t tagCount() const { return tags.size(); }
+
+    size_t imageSize() const { return image.size(); }
+    uint8_t* data() { return image.data(); }
+    const uint8_t* data() const { return image.data(); }
+    void printValue(std::ostream& out, TagRef ref) const;
+    bool applyValue(TagRef ref, const std::string& value); // a scalar from text: a number, true or false
+    void printMemoryReport(std::ostream& out) const;
+
+    bool getBool(TagRef ref) const {
+        return image[ref.offset / 8] & (1u << (ref.offset % 8));
+    }
+
+    void setBool(TagRef ref, bool value) {
+        uint8_t mask = 1u << (ref.offset % 8);
+        image[ref.offset / 8] = value ? (image[ref.offset / 8] | mask) : (image[ref.offset / 8] & ~mask);
+    }
+
+    template <typename Record>
+    Record getRecord(TagRef ref) const {
+        return load<Record>(ref.offset);
+    }
+
+    template <typename Record>
+    void setRecord(TagRef ref, const Record& record) {
+        store<Record>(ref.offset, record);
+    }
+
+    // Read any tag converted to T
+    template <typename T>
+    T get(TagRef ref) const {
+        switch (ref.type) {
+            case DataType::BOOL: return static_cast<T>(getBool(ref));
+            case DataType::SINT: return static_cast<T>(load<int8_t>(ref.offset));
+            case DataType::INT: return static_cast<T>(load<int16_t>(ref.offset));
+            case DataType::DINT: return static_cast<T>(load<int32_t>(ref.offset));
+            case DataType::LINT: return static_cast<T>(load<int64_t>(ref.offset));
+            case DataType::REAL: return static_cast<T>(load<float>(ref.offset));
+            case DataType::LREAL: return static_cast<T>(load<double>(ref.offset));
+            case DataType::STRUCT: break;
+        }
+        return T();
+    }
+
+    // Write a value converted to the tag's own type
+    template <typename T>
+    void set(TagRef ref, T value) {
+        switch (ref.type) {
+            case DataType::BOOL: setBool(ref, value != T()); break;
+            case DataType::SINT: store<int8_t>(ref.offset, static_cast<int8_t>(value)); break;
+            case DataType::INT: store<int16_t>(ref.offset, static_cast<int16_t>(value)); break;
+            case DataType::DINT: store<int32_t>(ref.offset, static_cast<int32_t>(value)); break;
+            case DataType::LINT: store<int64_t>(ref.offset, static_cast<int64_t>(value)); break;
+            case DataType::REAL: store<float>(ref.offset, static_cast<float>(value)); break;
+            case DataType::LREAL: store<double>(ref.offset, static_cast<double>(value)); break;
+            case DataType::STRUCT: break;
+        }
+    }
+
+private:
+    std::vector<StructType> structTypes;
+    std::vector<Tag> tags;
+    std::map<std::string, size_t> index;
+    std::vector<uint8_t> image;
+    uint32_t nextBit = 0; // next free bit in the last BOOL byte, 0 when there is none
+    bool laidOut = false;
+
+    TagRef allocate(DataType type, uint16_t structType, uint32_t count);
+    TagRef findElements(const std::string& name, size_t bracket) const;
+    bool applyInitialValue(const Tag& tag);
+    void printRecord(std::ostream& out, TagRef ref, const char* separator) const;
+    void printElements(std::ostream& out, TagRef ref, size_t limit) const;
+    std::string typeName(const Tag& tag) const;
+
+    template <typename T>
+    T load(uint32_t offset) const {
+        T value;
+        std::memcpy(&value, image.data() + offset, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void store(uint32_t offset, T value) {
+        std::memcpy(image.data() + offset, &value, sizeof(T));
+    }
+};
+
+#endif // TAG_DATABASE_H
@@ -0,0 +1,412 @@
+#include "TagPublisher.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <type_traits>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t MaxCommand = 65536;
+
+template <typename T>
+void appendNumber(std::string& out, T value) {
+    if constexpr (std::is_floating_point_v<T>) {
+        if (!std::isfinite(value)) {
+            out += "null";
+            return;
+        }
+    }
+    char text[32];
+    auto [end, error] = std::to_chars(text, text + sizeof(text), value);
+    out.append(text, end);
+}
+
+// A JSON string, names and messages can hold anything a client sent
+void appendString(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+}
+
+TagPublisher::TagPublisher(TagDatabase& tags, int tickMilliseconds) :
+    tags(tags),
+    view(tags),
+    imageSize(tags.imageSize()),
+    tick(std::chrono::milliseconds(std::max(tickMilliseconds, 1))) {
+    for (auto& buffer : buffers) {
+        buffer.assign(imageSize, 0);
+    }
+}
+
+TagPublisher::~TagPublisher() {
+    stop();
+}
+
+bool TagPublisher::start(int port) {
+    if (port >= 0) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        socklen_t length = sizeof(address);
+        if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+            bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            std::cerr << "Could not open tag publisher port " << port << ": " << std::strerror(errno) << std::endl;
+            if (listener >= 0) {
+                close(listener);
+                listener = -1;
+            }
+            return false;
+        }
+        listenPort = ntohs(address.sin_port);
+    }
+
+    wanted.store(true);
+    running.store(true);
+    thread = std::thread(&TagPublisher::run, this);
+    return true;
+}
+
+void TagPublisher::stop() {
+    running.store(false);
+    if (thread.joinable()) {
+        thread.join();
+    }
+    for (const auto& [fd, client] : clients) {
+        close(fd);
+    }
+    clients.clear();
+    if (listener >= 0) {
+        close(listener);
+        listener = -1;
+    }
+}
+
+bool TagPublisher::resolve(const std::vector<std::string>& names, int intervalMilliseconds, Subscription& subscription,
+                           std::string& error) const {
+    for (const auto& name : names) {
+        TagRef ref = view.find(name);
+        if (!ref) {
+            error = "unknown tag " + name;
+            return false;
+        }
+        subscription.names.push_back(name);
+        subscription.refs.push_back(ref);
+        subscription.offsets.push_back(static_cast<uint32_t>(subscription.lastValues.size()));
+        subscription.lastValues.resize(subscription.lastValues.size() + view.sizeOf(ref));
+    }
+    subscription.interval = std::chrono::milliseconds(std::max(intervalMilliseconds, 0));
+    return true;
+}
+
+size_t TagPublisher::subscribe(const std::vector<std::string>& names, int intervalMilliseconds, TagCallback callback) {
+    Subscription subscription;
+    std::string error;
+    if (!resolve(names, intervalMilliseconds, subscription, error)) {
+        std::cerr << "Cannot subscribe: " << error << std::endl;
+        return SIZE_MAX;
+    }
+    subscription.callback = std::move(callback);
+
+    size_t id = nextSubscription.fetch_add(1);
+    std::lock_guard<std::mutex> lock(mutex);
+    added.emplace_back(id, std::move(subscription));
+    return id;
+}
+
+void TagPublisher::unsubscribe(size_t subscription) {
+    std::lock_guard<std::mutex> lock(mutex);
+    removed.push_back(subscription);
+}
+
+void TagPublisher::scanEnd(long long scanClock) {
+    // Most scans end here, the publisher asks for one snapshot per tick
+    if (!wanted.load(std::memory_order_relaxed) || !wanted.exchange(false, std::memory_order_acquire)) {
+        return;
+    }
+    std::memcpy(buffers[back].data(), tags.data(), imageSize);
+    times[back] = scanClock;
+    back = ready.exchange(back | Fresh, std::memory_order_acq_rel) & ~Fresh;
+}
+
+void TagPublisher::run() {
+    Clock::time_point nextTick = Clock::now();
+    std::vector<pollfd> fds;
+    std::vector<int> closed;
+    while (running.load()) {
+        Clock::time_point now = Clock::now();
+        if (now >= nextTick) {
+            publish(now);
+            nextTick = std::max(nextTick + tick, now);
+        }
+
+        fds.clear();
+        if (listener >= 0) {
+            fds.push_back({listener, POLLIN, 0});
+        }
+        for (const auto& [fd, client] : clients) {
+            fds.push_back({fd, static_cast<short>(client.output.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+        }
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(nextTick - Clock::now()).count();
+        if (poll(fds.data(), fds.size(), static_cast<int>(std::max<long long>(wait, 0))) <= 0) {
+            continue;
+        }
+
+        closed.clear();
+        for (const auto& entry : fds) {
+            if (entry.fd == listener) {
+                if (entry.revents & POLLIN) {
+                    accept();
+                }
+                continue;
+            }
+            Client& client = clients[entry.fd];
+            if (((entry.revents & POLLOUT) && !flush(entry.fd, client)) ||
+                ((entry.revents & (POLLIN | POLLHUP | POLLERR)) && !receive(entry.fd, client))) {
+                closed.push_back(entry.fd);
+            }
+        }
+        for (int fd : closed) {
+            closeClient(fd);
+        }
+    }
+}
+
+void TagPublisher::accept() {
+    int fd = ::accept(listener, nullptr, nullptr);
+    if (fd >= 0) {
+        clients[fd];
+    }
+}
+
+bool TagPublisher::receive(int fd, Client& client) {
+    char buffer[4096];
+    ssize_t received = read(fd, buffer, sizeof(buffer));
+    if (received <= 0) {
+        return false;
+    }
+
+    client.input.append(buffer, received);
+    size_t newline;
+    while ((newline = client.input.find('\n')) != std::string::npos) {
+        std::string line = client.input.substr(0, newline);
+        client.input.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            execute(fd, client, line);
+        }
+    }
+    return client.input.size() < MaxCommand && flush(fd, client);
+}
+
+bool TagPublisher::flush(int fd, Client& client) {
+    if (client.output.empty()) {
+        return true;
+    }
+    ssize_t sent = send(fd, client.output.data(), client.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    client.output.erase(0, sent);
+    return true;
+}
+
+void TagPublisher::execute(int fd, Client& client, const std::string& command) {
+    std::istringstream iss(command);
+    std::string verb;
+    iss >> verb;
+    std::vector<std::string> names;
+    for (std::string name; iss >> name;) {
+        names.push_back(name);
+    }
+
+    if (verb == "unsubscribe" && names.empty()) {
+        subscriptions.erase(client.subscription);
+        client.subscription = SIZE_MAX;
+        return;
+    }
+
+    // The client keeps its subscription unless the new one is valid
+    int interval = 0;
+    Subscription subscription;
+    std::string error = "expected subscribe <interval_ms> <tag> [<tag>...] or unsubscribe";
+    if (verb != "subscribe" || names.size() < 2 || std::from_chars(names[0].data(), names[0].data() + names[0].size(), interval).ec != std::errc() ||
+        !resolve(std::vector<std::string>(names.begin() + 1, names.end()), interval, subscription, error)) {
+        client.output += "{\"error\":";
+        appendString(client.output, error);
+        client.output += "}\n";
+        return;
+    }
+
+    subscriptions.erase(client.subscription);
+    subscription.client = fd;
+    client.subscription = nextSubscription.fetch_add(1);
+    subscriptions.emplace(client.subscription, std::move(subscription));
+}
+
+void TagPublisher::closeClient(int fd) {
+    subscriptions.erase(clients[fd].subscription);
+    clients.erase(fd);
+    close(fd);
+}
+
+void TagPublisher::publish(Clock::time_point now) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& [id, subscription] : added) {
+            subscriptions.emplace(id, std::move(subscription));
+        }
+        for (size_t id : removed) {
+            subscriptions.erase(id);
+        }
+        added.clear();
+        removed.clear();
+    }
+
+    if (ready.load(std::memory_order_relaxed) & Fresh) {
+        front = ready.exchange(front, std::memory_order_acq_rel) & ~Fresh;
+        std::memcpy(view.data(), buffers[front].data(), imageSize);
+        snapshotTime = times[front];
+        ++snapshot;
+        ++snapshots;
+    }
+    // Asked for now, it arrives with the end of the next scan and is published on the next tick
+    wanted.store(true, std::memory_order_release);
+
+    for (auto& [id, subscription] : subscriptions) {
+        publish(id, subscription, now);
+    }
+    for (auto& [fd, client] : clients) {
+        flush(fd, client);
+    }
+}
+
+void TagPublisher::publish(size_t id, Subscription& subscription, Clock::time_point now) {
+    if (subscription.seen == snapshot || now < subscription.due) {
+        return;
+    }
+    Client* client = subscription.client >= 0 ? &clients[subscription.client] : nullptr;
+    if (client && !client->output.empty()) {
+        // The changes stay unsent, so they go out together with the next ones
+        ++heldBack;
+        return;
+    }
+    subscription.seen = snapshot;
+
+    changes.clear();
+    const uint8_t* image = view.data();
+    for (size_t i = 0; i < subscription.refs.size(); ++i) {
+        TagRef ref = subscription.refs[i];
+        uint8_t* last = subscription.lastValues.data() + subscription.offsets[i];
+        if (ref.type == DataType::BOOL) {
+            uint8_t value = view.getBool(ref);
+            if (value == *last && !subscription.initial) {
+                continue;
+            }
+            *last = value;
+        } else {
+            size_t size = view.sizeOf(ref);
+            if (std::memcmp(last, image + ref.offset, size) == 0 && !subscription.initial) {
+                continue;
+            }
+            std::memcpy(last, image + ref.offset, size);
+        }
+        changes.push_back(TagChange{subscription.names[i], ref});
+    }
+    if (changes.empty()) {
+        return;
+    }
+
+    ++batches;
+    valuesSent += changes.size();
+    subscription.due = now + subscription.interval;
+    if (client) {
+        writeBatch(client->output);
+    } else {
+        subscription.callback(TagBatch{id, snapshotTime, subscription.initial, view, changes});
+    }
+    subscription.initial = false;
+}
+
+void TagPublisher::writeBatch(std::string& out) {
+    out += "{\"time\":";
+    appendNumber(out, snapshotTime);
+    out += ",\"values\":{";
+    for (size_t i = 0; i < changes.size(); ++i) {
+        out += i > 0 ? "," : "";
+        appendString(out, changes[i].name);
+        out += ":";
+        writeValue(out, changes[i].ref);
+    }
+    out += "}}\n";
+}
+
+void TagPublisher::writeValue(std::string& out, TagRef ref) const {
+    if (ref.count > 1) {
+        TagRef element = ref;
+        element.count = 1;
+        out += "[";
+        for (uint32_t i = 0; i < ref.count; ++i) {
+            element.offset = ref.offset + i * dataTypeSize(ref.type);
+            out += i > 0 ? "," : "";
+            writeValue(out, element);
+        }
+        out += "]";
+        return;
+    }
+
+    switch (ref.type) {
+        case DataType::BOOL: out += view.getBool(ref) ? "true" : "false"; break;
+        case DataType::REAL: appendNumber(out, view.get<float>(ref)); break;
+        case DataType::LREAL: appendNumber(out, view.get<double>(ref)); break;
+        case DataType::STRUCT: {
+            const auto& members = view.structType(ref.structType).members;
+            out += "{";
+            for (size_t i = 0; i < members.size(); ++i) {
+                TagRef member;
+                member.type = members[i].type;
+                member.offset = member.type == DataType::BOOL ? ref.offset * 8 + members[i].offset : ref.offset + members[i].offset;
+                out += i > 0 ? "," : "";
+                appendString(out, members[i].name);
+                out += ":";
+                writeValue(out, member);
+            }
+            out += "}";
+            break;
+        }
+        default: appendNumber(out, view.get<long long>(ref)); break;
+    }
+}
+
+void TagPublisher::printSummary(std::ostream& out) const {
+    out << "Tag publisher: " << subscriptions.size() << " subscriptions, " << snapshots << " snapshots, " << batches << " batches, "
+        << valuesSent << " values sent, " << heldBack << " batches held back" << std::endl;
+}
@@ -0,0 +1,138 @@
+#ifndef TAG_PUBLISHER_H
+#define TAG_PUBLISHER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "TagDatabase.h"
+
+// A subscribed tag whose value changed, named as it was subscribed
+struct TagChange {
+    std::string_view name;
+    TagRef ref;
+};
+
+struct TagBatch {
+    size_t subscription;
+    long long time; // scan clock of the snapshot, in microseconds
+    bool initial; // the first batch of a subscription holds every tag of it
+    const TagDatabase& values; // the tags as of the snapshot, read the changes with get<T>(), getBool() or printValue()
+    std::span<const TagChange> changes;
+};
+
+using TagCallback = std::function<void(const TagBatch& batch)>;
+
+// Sends the tags that changed to subscribers, at most once per subscriber's interval, instead of dumping every tag.
+//
+// At the end of a scan the scan thread copies the tag image into a free snapshot buffer, and only when the publisher
+// thread asked for one, once per tick. Buffers are handed over through an atomic triple buffer, so the scan never
+// waits or allocates. The publisher thread compares each due subscription's tags with the values it last sent and
+// delivers all changes of the interval as one batch, so a value that changed several times is sent once.
+//
+// Subscribers are in-process callbacks, called on the publisher thread, or clients of a loopback TCP port sending
+// one text command per line and receiving one JSON object per batch:
+//
+//   subscribe <interval_ms> <tag> [<tag>...]    replaces the client's subscription, unless it is rejected
+//   unsubscribe
+//
+//   {"time":1250000,"values":{"level":520,"run_pump":true}}
+//
+// Tags declared after the publisher was created are not published.
+class TagPublisher {
+public:
+    explicit TagPublisher(TagDatabase& tags, int tickMilliseconds = 10);
+    ~TagPublisher();
+
+    bool start(int port = -1); // -1 for callbacks only, 0 for any free port
+    void stop();
+    int port() const { return listenPort; }
+
+    // Any thread, also from a callback. SIZE_MAX if a tag does not exist.
+    size_t subscribe(const std::vector<std::string>& names, int intervalMilliseconds, TagCallback callback);
+    void unsubscribe(size_t subscription);
+
+    void scanEnd(long long scanClock); // called by the parser, after everything that writes tags
+
+    // Counted on the publisher thread, read them after stop()
+    long long snapshots = 0;
+    long long batches = 0;
+    long long valuesSent = 0;
+    long long heldBack = 0; // batches postponed because a client had not read the previous one yet
+    void printSummary(std::ostream& out) const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr unsigned Fresh = 4; // in ready, next to the buffer index
+
+    struct Subscription {
+        std::vector<std::string> names;
+        std::vector<TagRef> refs;
+        std::vector<uint32_t> offsets; // of each tag's last sent value in lastValues
+        std::vector<uint8_t> lastValues;
+        Clock::duration interval;
+        Clock::time_point due{};
+        long long seen = -1; // the last snapshot compared
+        bool initial = true;
+        TagCallback callback;
+        int client = -1; // or the socket of a network subscriber
+    };
+
+    struct Client {
+        std::string input;
+        std::string output; // not yet sent
+        size_t subscription = SIZE_MAX;
+    };
+
+    TagDatabase& tags;
+    TagDatabase view; // the publisher's copy, holds the last snapshot
+    size_t imageSize;
+    Clock::duration tick;
+
+    // The triple buffer: the scan thread fills back, the publisher thread reads front
+    std::vector<uint8_t> buffers[3];
+    long long times[3] = {};
+    unsigned back = 0;
+    std::atomic<unsigned> ready{1};
+    unsigned front = 2;
+    std::atomic<bool> wanted{false};
+
+    // Subscription changes from other threads, applied by the publisher thread each tick
+    std::mutex mutex;
+    std::vector<std::pair<size_t, Subscription>> added;
+    std::vector<size_t> removed;
+    std::atomic<size_t> nextSubscription{0};
+
+    // Publisher thread only
+    std::map<size_t, Subscription> subscriptions;
+    std::map<int, Client> clients;
+    std::vector<TagChange> changes;
+    long long snapshot = 0;
+    long long snapshotTime = 0;
+    int listener = -1;
+    int listenPort = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    bool resolve(const std::vector<std::string>& names, int intervalMilliseconds, Subscription& subscription, std::string& error) const;
+    void run();
+    void publish(Clock::time_point now);
+    void publish(size_t id, Subscription& subscription, Clock::time_point now);
+    void writeBatch(std::string& out);
+    void writeValue(std::string& out, TagRef ref) const;
+    void accept();
+    bool receive(int fd, Client& client);
+    bool flush(int fd, Client& client);
+    void execute(int fd, Client& client, const std::string& command);
+    void closeClient(int fd);
+};
+
+#endif // TAG_PUBLISHER_H
@@ -1,20 +1,45 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <string>
-#include <map>
-#include <variant>
 #include <vector>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
 #include "LadderLogicParser.h"
+#include "AllocationCounter.h"
+#include "RealtimeRuntime.h"
+#include "ControllerHost.h"
+#include "Debugger.h"
+#include "ScanJournal.h"
+#include "AlarmEngine.h"
+#include "TagPublisher.h"
+#include "EmbeddedProgram.h"
 
-// Define the variant type for variables
-using Variable = std::variant<int, bool, double>;
-std::map<std::string, Variable> variableMap;
+TagDatabase tags;
 
-// Function to load variables from a file
-void loadVariables(const std::string& filename) {
+// The tank program of logic4.txt and variables.txt, compiled into the executable for --embedded
+using EmbeddedTank = embedded::Program<R"(high real 1000
+inflow real 10
+level real 790
+low real 400
+outflow real 30
+run_pump bool 0
+start_pump bool 0
+stop_pump bool 0
+)", R"(A true SPS with latching and branches
+
+001 ADD(level,inflow,level)
+002 GTR(level,high) OTE(start_pump)
+003 LSS(level,low) OTE(stop_pump)
+004 XIC(run_pump) SUB(level,outflow,level)
+005 BST XIC(start_pump) NXB XIC(run_pump) BND XIO(stop_pump) OTE(run_pump)
+)">;
+
+// Function to load logic from a file
+void loadLogic(const std::string& filename, std::vector<std::string>& logic) {
     std::ifstream file(filename);
     if (!file) {
         std::cerr << "Failed to open " << filename << std::endl;
@@ -22,78 +47,140 @@ void loadVariables(const std::string& filename) {
     }
     std::string line;
     while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string name, type;
-        iss >> name >> type;
-        if (type == "int") {
-            int value;
-            iss >> value;
-            variableMap[name] = value;
-        } else if (type == "bool") {
-            bool value;
-            iss >> value;
-            variableMap[name] = value;
-        } else if (type == "real") {
-            double value;
-            iss >> value;
-            variableMap[name] = value;
-        }
+        logic.push_back(line);
     }
 }
 
-// Function to save variables to a file
-void saveVariables(const std::string& filename, const std::map<std::string, Variable>& variableMap) {
-    std::ofstream file(filename);
-    if (!file) {
-        std::cerr << "Failed to open " << filename << std::endl;
-        return;
-    }
-    for (const auto& [name, value] : variableMap) {
-        file << name << " ";
-        if (std::holds_alternative<int>(value)) {
-            file << "int " << std::get<int>(value) << "\n";
-        } else if (std::holds_alternative<bool>(value)) {
-            file << "bool " << std::get<bool>(value) << "\n";
-        } else if (std::holds_alternative<double>(value)) {
-            file << "real " << std::get<double>(value) << "\n";
-        }
+void printVariables(const TagDatabase& tags) {
+    for (const auto& [name, i] : tags.names()) {
+        std::cout << name << " = ";
+        tags.printValue(std::cout, tags.tag(i).ref);
+        std::cout << std::endl;
     }
 }
 
-std::string toString(bool value) {
-    return value ? "true" : "false";
+// Flushes the journal and reports what it recorded
+void closeJournal(ScanJournal* journal) {
+    if (journal) {
+        journal->close();
+        std::cout << "Journal: " << journal->records << " scans, " << journal->bytesWritten() << " bytes, "
+                  << journal->droppedRecords << " scans dropped" << std::endl;
+    }
 }
 
-// Function to load logic from a file
-void loadLogic(const std::string& filename, std::vector<std::string>& logic) {
-    std::ifstream file(filename);
-    if (!file) {
-        std::cerr << "Failed to open " << filename << std::endl;
-        return;
-    }
-    std::string line;
-    while (std::getline(file, line)) {
-        logic.push_back(line);
+// Stops the publisher and reports what it sent
+void closePublisher(TagPublisher* publisher) {
+    if (publisher) {
+        publisher->stop();
+        publisher->printSummary(std::cout);
     }
 }
 
-void printVariables(const std::map<std::string, Variable>& variableMap) {
-    for (const auto& [name, value] : variableMap) {
-        std::cout << name << " = ";
-        if (std::holds_alternative<int>(value)) {
-            std::cout << std::get<int>(value);
-        } else if (std::holds_alternative<bool>(value)) {
-            std::cout << toString(std::get<bool>(value));
-        } else if (std::holds_alternative<double>(value)) {
-            std::cout << std::get<double>(value);
+// Writes alarm events to a file as they come, on its own thread, until stopped
+class AlarmLog {
+public:
+    AlarmLog(AlarmEngine& alarms, const std::string& filename) : alarms(alarms), file(filename) {
+        if (!file) {
+            std::cerr << "Could not open alarm log " << filename << std::endl;
+            return;
         }
-        std::cout << std::endl;
+        thread = std::thread([this]() {
+            AlarmEvent event;
+            while (running.load()) {
+                while (this->alarms.events.pop(event)) {
+                    write(event);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            while (this->alarms.events.pop(event)) {
+                write(event);
+            }
+        });
+    }
+
+    ~AlarmLog() {
+        running.store(false);
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+private:
+    AlarmEngine& alarms;
+    std::ofstream file;
+    std::thread thread;
+    std::atomic<bool> running{true};
+
+    void write(const AlarmEvent& event) {
+        static const char* kinds[] = {"raised", "cleared", "acknowledged"};
+        file << event.time / 1000 << " ms " << alarms.name(event.alarm) << " " << kinds[static_cast<int>(event.kind)]
+             << " priority " << event.priority << " value " << event.value << "\n";
+    }
+};
+
+// Polls the logic file and hands every new version to the parser, which applies the changed rungs between scans
+class LogicWatcher {
+public:
+    LogicWatcher(LadderLogicParser& parser, const std::string& filename) : parser(parser), filename(filename) {
+        std::error_code error;
+        lastWrite = std::filesystem::last_write_time(filename, error);
+        thread = std::thread([this]() {
+            while (running.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                std::error_code error;
+                auto written = std::filesystem::last_write_time(this->filename, error);
+                if (error || written == lastWrite) {
+                    continue;
+                }
+                lastWrite = written;
+                std::vector<std::string> logic;
+                loadLogic(this->filename, logic);
+                this->parser.requestReload(logic);
+            }
+        });
+    }
+
+    ~LogicWatcher() {
+        running.store(false);
+        thread.join();
     }
-}
+
+private:
+    LadderLogicParser& parser;
+    std::string filename;
+    std::filesystem::file_time_type lastWrite;
+    std::thread thread;
+    std::atomic<bool> running{true};
+};
 
 int main(int argc, char* argv[]) {
     std::string logicFile = "logic4.txt";
+    std::string variablesFile = "variables.txt";
+    bool memoryReport = false;
     bool testMode = false;
+    bool simulationMode = false;
+    bool verbose = false;
+    bool allocationCheck = false;
+    bool realtimeMode = false;
+    bool realtimeSelfCheck = false;
+    bool embeddedMode = false;
+    bool watchLogic = false;
+    bool messageSelfTest = false;
+    bool debuggerSelfTest = false;
+    RealtimeOptions realtimeOptions;
+    std::string hostConfig;
+    std::string debugSocket;
+    std::string journalFile;
+    std::string replayFile;
+    std::string alarmFile;
+    std::string alarmLogFile;
+    int publishPort = -1;
+    size_t pidBenchmarkLoops = 0;
+    size_t alarmBenchmarkPoints = 0;
+    size_t hostWorkers = std::max(1u, std::thread::hardware_concurrency());
+    int simulationTick = 10000; // in microseconds
+    long long scanLimit = 0; // 0 means no limit
+    long long durationLimit = 0; // simulated duration in milliseconds, 0 means no limit
 
     // Parse command-line arguments
     for (int i = 1; i < argc; ++i) {
@@ -104,24 +191,319 @@ int main(int argc, char* argv[]) {
         if (std::string(argv[i]) == "-t") {
             testMode = true;
         }
+
+        if (std::string(argv[i]) == "-s") {
+            simulationMode = true;
+            if (i + 1 < argc && isdigit(argv[i + 1][0])) {
+                simulationTick = std::stoi(argv[++i]);
+            }
+        }
+
+        if (std::string(argv[i]) == "-n" && i + 1 < argc) {
+            scanLimit = std::stoll(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "-d" && i + 1 < argc) {
+            durationLimit = std::stoll(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "-w") {
+            watchLogic = true;
+        }
+
+        if (std::string(argv[i]) == "-v") {
+            verbose = true;
+        }
+
+        if (std::string(argv[i]) == "-a") {
+            allocationCheck = true;
+        }
+
+        if (std::string(argv[i]) == "-V" && i + 1 < argc) {
+            variablesFile = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "-m") {
+            memoryReport = true;
+        }
+
+        if (std::string(argv[i]) == "-c" && i + 1 < argc) {
+            hostConfig = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "--workers" && i + 1 < argc) {
+            hostWorkers = std::stoul(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--pid-bench" && i + 1 < argc) {
+            pidBenchmarkLoops = std::stoul(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--msg-selftest") {
+            messageSelfTest = true;
+        }
+
+        if (std::string(argv[i]) == "--debug-selftest") {
+            debuggerSelfTest = true;
+        }
+
+        if (std::string(argv[i]) == "--alarm-bench" && i + 1 < argc) {
+            alarmBenchmarkPoints = std::stoul(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--alarms" && i + 1 < argc) {
+            alarmFile = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "--alarm-log" && i + 1 < argc) {
+            alarmLogFile = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "--publish" && i + 1 < argc) {
+            publishPort = std::stoi(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--debug" && i + 1 < argc) {
+            debugSocket = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "--journal" && i + 1 < argc) {
+            journalFile = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+        }
+
+        if (std::string(argv[i]) == "--embedded") {
+            embeddedMode = true;
+        }
+
+        if (std::string(argv[i]) == "--realtime") {
+            realtimeMode = true;
+        }
+
+        if (std::string(argv[i]) == "--selftest") {
+            realtimeSelfCheck = true;
+        }
+
+        if (std::string(argv[i]) == "--cpu" && i + 1 < argc) {
+            realtimeOptions.cpu = std::stoi(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--priority" && i + 1 < argc) {
+            realtimeOptions.priority = std::stoi(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--period" && i + 1 < argc) {
+            realtimeOptions.periodMicroseconds = std::stoi(argv[++i]);
+        }
+
+        if (std::string(argv[i]) == "--max-latency" && i + 1 < argc) {
+            realtimeOptions.maxLatency = std::stoll(argv[++i]);
+        }
     }
 
-    // Load variables
-    loadVariables("variables.txt");
+    if (pidBenchmarkLoops > 0) {
+        // Every loop due on every update, about ten million loop updates in total
+        int updates = std::max<size_t>(10, 10000000 / pidBenchmarkLoops);
+        double rate = PidEngine::benchmark(pidBenchmarkLoops, updates);
+        std::cout << "PID benchmark: " << pidBenchmarkLoops << " loops, " << updates << " updates, " << rate << " loops/us" << std::endl;
+        return 0;
+    }
+
+    if (messageSelfTest) {
+        // READ, WRITE, SEND and RECEIVE against a temporary file and a loopback port
+        return MessageExecutor::selfTest(std::cout) ? 0 : 1;
+    }
+
+    if (debuggerSelfTest) {
+        // A client that disconnects at a breakpoint must not leave the scan paused
+        return Debugger::selfTest(std::cout) ? 0 : 1;
+    }
+
+    if (alarmBenchmarkPoints > 0) {
+        int updates = std::max<size_t>(10, 10000000 / alarmBenchmarkPoints);
+        double rate = AlarmEngine::benchmark(alarmBenchmarkPoints, updates);
+        std::cout << "Alarm benchmark: " << alarmBenchmarkPoints << " alarms, " << updates << " updates, " << rate << " alarms/us" << std::endl;
+        return 0;
+    }
+
+    if (!hostConfig.empty()) {
+        // Many controllers, each with its own logic, variables and period, on one pool of worker threads
+        ControllerHost host(hostWorkers);
+        if (!host.loadConfig(hostConfig) || host.controllerCount() == 0) {
+            std::cerr << "No controllers to run from " << hostConfig << std::endl;
+            return 1;
+        }
+        host.run(durationLimit);
+        host.printReport(std::cout);
+        return 0;
+    }
 
-    // Load logic
+    // Load variables and logic, unless they were compiled in
     std::vector<std::string> logic;
-    loadLogic(logicFile, logic);
+    if (embeddedMode) {
+        EmbeddedTank::view().loadTags(tags);
+    } else {
+        tags.loadFromFile(variablesFile);
+        loadLogic(logicFile, logic);
+    }
+
+    // Alarm points add their BOOL tags, so they are loaded before the logic refers to them
+    std::unique_ptr<AlarmEngine> alarms;
+    if (!alarmFile.empty()) {
+        alarms = std::make_unique<AlarmEngine>(tags);
+        if (!alarms->loadFromFile(alarmFile)) {
+            return 1;
+        }
+    }
 
     // Initialize the parser once
-    LadderLogicParser parser(logic, variableMap);
+    LadderLogicParser parser = embeddedMode ? LadderLogicParser(EmbeddedTank::view(), tags) : LadderLogicParser(logic, tags);
+
+    std::unique_ptr<AlarmLog> alarmLog;
+    if (alarms) {
+        parser.setAlarms(alarms.get());
+        if (!alarmLogFile.empty()) {
+            alarmLog = std::make_unique<AlarmLog>(*alarms, alarmLogFile);
+        }
+    }
 
-    if (testMode) {
+    // Edits to the logic file are downloaded into the running program
+    std::unique_ptr<LogicWatcher> watcher;
+    if (watchLogic && !embeddedMode) {
+        watcher = std::make_unique<LogicWatcher>(parser, logicFile);
+    }
+
+    // Online debugger on a local socket, breakpoints only stop a simulated clock
+    std::unique_ptr<Debugger> debugger;
+    if (!debugSocket.empty()) {
+        debugger = std::make_unique<Debugger>(parser, tags, simulationMode);
+        if (!debugger->start(debugSocket)) {
+            return 1;
+        }
+        parser.setDebugger(debugger.get());
+        debugger->setAlarms(alarms.get());
+    }
+
+    // Changed tags for HMIs on a loopback port, at the rate each client subscribes with
+    std::unique_ptr<TagPublisher> publisher;
+    if (publishPort >= 0) {
+        publisher = std::make_unique<TagPublisher>(tags);
+        if (!publisher->start(publishPort)) {
+            return 1;
+        }
+        parser.setPublisher(publisher.get());
+        std::cout << "Publishing tags on 127.0.0.1:" << publisher->port() << std::endl;
+    }
+
+    std::unique_ptr<ScanJournal> journal;
+    if (!journalFile.empty() && replayFile.empty()) {
+        journal = std::make_unique<ScanJournal>(tags);
+        if (!journal->open(journalFile)) {
+            return 1;
+        }
+        parser.setJournal(journal.get());
+    }
+
+    if (memoryReport) {
+        tags.printMemoryReport(std::cout);
+        return 0;
+    }
+
+    if (!replayFile.empty()) {
+        // Feed a journal back through the logic, scan for scan, as fast as the machine goes
+        parser.traceEnabled = verbose;
+        ReplayResult result;
+        auto wallStart = std::chrono::steady_clock::now();
+        if (!ScanJournal::replay(replayFile, parser, tags, result)) {
+            return 1;
+        }
+        auto wallTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wallStart).count();
+
+        std::cout << "-------" << "Variables after replay:" << "-------" << std::endl;
+        printVariables(tags);
+        std::cout << "Scans: " << result.scans << std::endl;
+        std::cout << "Recorded time: " << (result.lastTimestamp - result.firstTimestamp) / 1000 << " ms" << std::endl;
+        std::cout << "Scan clock: " << parser.scanClock / 1000 << " ms" << std::endl;
+        std::cout << "Wall time: " << wallTime << " ms" << std::endl;
+        std::cout << "-------" << "-------" << std::endl;
+        return 0;
+    } else if (realtimeMode || realtimeSelfCheck) {
+        // Periodic scans on a pinned SCHED_FIFO thread, console output goes through the logger thread
+        realtimeOptions.scanLimit = scanLimit;
+        parser.traceEnabled = verbose;
+        RealtimeRuntime runtime(parser, tags, realtimeOptions);
+        bool passed = realtimeSelfCheck ? runtime.selfCheck() : runtime.run();
+        if (!realtimeSelfCheck) {
+            std::cout << "-------" << "Variables after real-time run:" << "-------" << std::endl;
+            printVariables(tags);
+            std::cout << "-------" << "-------" << std::endl;
+        }
+        closeJournal(journal.get());
+        closePublisher(publisher.get());
+        if (alarms) {
+            alarms->printSummary(std::cout);
+        }
+        return passed ? 0 : 1;
+    } else if (allocationCheck) {
+        // The first scan may allocate (stream buffers and so on), every scan after it must not
+        if (simulationMode) {
+            parser.setVirtualClock(simulationTick);
+        }
+        parser.traceEnabled = verbose;
+        if (scanLimit == 0) {
+            scanLimit = 1000;
+        }
+
+        parser.executeLogic();
+        startCountingAllocations();
+        for (long long scan = 1; scan < scanLimit; ++scan) {
+            parser.executeLogic();
+        }
+        stopCountingAllocations();
+
+        std::cout << "Scans after the first: " << scanLimit - 1 << std::endl;
+        std::cout << "Allocations: " << allocationCount() << " (" << allocatedBytes() << " bytes)" << std::endl;
+        if (allocationCount() != 0) {
+            std::cerr << "Allocation check failed: the scan allocated memory" << std::endl;
+            return 1;
+        }
+        std::cout << "Allocation check passed" << std::endl;
+    } else if (simulationMode) {
+        // Run scans back-to-back on a virtual clock, each scan advances the timers by one tick
+        if (scanLimit == 0 && durationLimit == 0) {
+            std::cerr << "Simulation mode needs a scan limit (-n) or a simulated duration (-d)" << std::endl;
+            return 1;
+        }
+        if (scanLimit == 0) {
+            scanLimit = (durationLimit * 1000 + simulationTick - 1) / simulationTick;
+        }
+
+        parser.setVirtualClock(simulationTick);
+        parser.traceEnabled = verbose;
+
+        auto wallStart = std::chrono::steady_clock::now();
+        for (long long scan = 0; scan < scanLimit; ++scan) {
+            parser.executeLogic();
+        }
+        auto wallTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wallStart).count();
+
+        std::cout << "-------" << "Variables after simulation:" << "-------" << std::endl;
+        printVariables(tags);
+        std::cout << "Scans: " << scanLimit << std::endl;
+        std::cout << "Simulated time: " << parser.simulatedTime / 1000 << " ms" << std::endl;
+        std::cout << "Wall time: " << wallTime << " ms" << std::endl;
+        std::cout << "Shared rung prefixes: " << parser.sharedPrefixCount() << " used by " << parser.sharedPrefixRungs() << " rungs, "
+                  << parser.skippedEvaluations << " instruction evaluations removed" << std::endl;
+        std::cout << "-------" << "-------" << std::endl;
+    } else if (testMode) {
         // Keep scanning with a delay of 10ms
-        while (true) {
+        for (long long scan = 0; scanLimit == 0 || scan < scanLimit; ++scan) {
             // Print variables before execution
             std::cout << "-------" << "Variables before execution:" << "-------" << std::endl;
-            printVariables(variableMap);
+            printVariables(tags);
             std::cout << "-------" << "-------" << std::endl;
 
             // Execute logic without re-initializing the parser
@@ -129,12 +511,12 @@ int main(int argc, char* argv[]) {
 
             // Print variables after execution
             std::cout << "-------" << "Variables after execution:" << "-------" << std::endl;
-            printVariables(variableMap);
+            printVariables(tags);
             std::cout << "Scan time: " << parser.scanTime << " us" << std::endl;
             std::cout << "-------" << "-------" << std::endl;
 
             // Save variables
-            // saveVariables("variables.txt", variableMap); //Standly with the new mapping routine this core dumps
+            // tags.saveToFile("variables.txt"); //Standly with the new mapping routine this core dumps
 
             // Delay for 10ms
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -144,7 +526,7 @@ int main(int argc, char* argv[]) {
 
         // Print variables before execution
         std::cout << "-------" << "Variables before execution:" << "-------" << std::endl;
-        printVariables(variableMap);
+        printVariables(tags);
         std::cout << "-------" << "-------" << std::endl;
 
         // Execute logic without re-initializing the parser
@@ -152,13 +534,18 @@ int main(int argc, char* argv[]) {
 
         // Print variables after execution
         std::cout << "-------" << "Variables after execution:" << "-------" << std::endl;
-        printVariables(variableMap);
+        printVariables(tags);
         std::cout << "Scan time: " << parser.scanTime << " ms" << std::endl;
         std::cout << "-------" << "-------" << std::endl;
 
         // Save variables
-        // saveVariables("variables.txt", variableMap);
+        // tags.saveToFile("variables.txt");
     }
 
+    closeJournal(journal.get());
+    closePublisher(publisher.get());
+    if (alarms) {
+        alarms->printSummary(std::cout);
+    }
     return 0;
 }